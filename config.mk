@@ -15,6 +15,9 @@ BUILDDIR := build
 # Flags
 CFLAGS += -std=gnu99 -pedantic -Wall -Wextra -Wno-unused-parameter
 CFLAGS += -I${INCDIR} -I.
+CFLAGS += -pthread
+
+LDFLAGS += -pthread
 
 ifeq ($(ENV),dev)
 CFLAGS += -Og -g -DDEV
@@ -31,3 +34,10 @@ CFLAGS += -I${TBDIR}
 # c_vector lib
 CVDIR  := ${LIBDIR}/c-vector
 CFLAGS += -I${CVDIR}
+
+# PCRE2 lib, set PCRE2 to 1 to search with its JIT instead of regex.h
+PCRE2 ?= 0
+ifeq ($(PCRE2),1)
+CFLAGS += -DPCRE2 $(shell pkg-config --cflags libpcre2-8 2>/dev/null)
+LDLIBS += $(shell pkg-config --libs libpcre2-8 2>/dev/null || echo -lpcre2-8)
+endif
@@ -4,8 +4,14 @@
 "Options:" "\n" \
 "       --fold, -f" "\n" \
 "              Fold directories by default." "\n" \
+"       --index=<MIB>, -i <MIB>" "\n" \
+"              Index names of paths after they are loaded, so that search skips paths that can't match.  The index takes up to MIB mebibytes of memory; paths that don't fit into it are always searched.  Paths are not indexed by default." "\n" \
+"       --jobs=<N>, -j <N>" "\n" \
+"              Use N threads to sort and search paths.  The number of available processors is the default value." "\n" \
 "       --separator=<C>, -s <C>" "\n" \
 "              Set directory separator to C.  / is the default value." "\n" \
+"       --stats=<FILE>, -S <FILE>" "\n" \
+"              Write the numbers shown by ^G to FILE on exit." "\n" \
 "       --help, -h" "\n" \
 "              Print a help message and exit." "\n" \
 "       --version, -v" "\n" \
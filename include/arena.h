@@ -0,0 +1,45 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+/* Size of a block memory is allocated from */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+/* Number of power of two sizes that can be recycled */
+#define ARENA_SIZE_CLASSES 48
+
+/*
+ * Memory that is only freed all at once. Chunks with power of two sizes can
+ * be recycled to be reused by later allocations of the same size.
+ */
+typedef struct Arena {
+    char **blocks;
+    char *ptr;
+    size_t left;
+    void *recycled[ARENA_SIZE_CLASSES];
+} Arena;
+
+void *alloc_arena(Arena *arena, size_t size);
+void recycle_arena(Arena *arena, void *ptr, size_t size);
+void free_arena(Arena *arena);
+
+#endif
@@ -32,6 +32,9 @@ typedef struct Options {
     char *filename;
     PathState init_paths_state;
     char separator;
+    unsigned jobs;
+    size_t index_size; /* Maximum size of the trigram index, 0 to disable it */
+    char *stats_file;  /* File that timings are written to on exit */
 } Options;
 
 enum ArgAction process_args(Options *options, int argc, char **argv);
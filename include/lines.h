@@ -24,13 +24,23 @@
 
 #define LINE_DELIM '\n'
 
+/* Size of a chunk of input read at once */
+#define READ_BLOCK_SIZE (1 << 20)
+
 typedef struct Lines {
     char **lines;
     size_t lines_l;
+    char **blocks;
+    char *map;
+    size_t map_l;
+    char separator;
 } Lines;
 
-Lines get_lines(FILE *stream, char separator);
+/* Called every time a new portion of input has been split into lines.
+ * Lines are removed from the vector after the callback returns. */
+typedef void (*LinesCallback)(Lines *lines);
+
+int get_lines(Lines *lines, FILE *stream, char separator, LinesCallback callback);
 void free_lines(Lines *lines);
-void sort_lines(Lines lines);
 
 #endif
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdio.h>
+
+#include "paths.h"
+
+typedef enum LoaderState {
+    LoaderStateReading,
+    LoaderStateDone,
+    LoaderStateError,
+} LoaderState;
+
+typedef struct LoaderStatus {
+    LoaderState state;
+    size_t lines_l;
+    size_t paths_l;
+} LoaderStatus;
+
+int start_loader(FILE *stream, char separator, PathState init_state, unsigned jobs,
+                 size_t index_size);
+LoaderStatus get_loader_status(void);
+LoaderStatus wait_loader(int timeout_ms);
+void stop_loader(void);
+
+#endif
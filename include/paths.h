@@ -39,19 +39,21 @@ typedef struct PathLink {
 
 typedef struct Path {
     char *line;
-    char *full_path;
     PathState state;
     unsigned depth;
     PathLink mainpath;
     PathLink* subpaths;
     size_t subpaths_l;
+    size_t subpaths_cap;
+    size_t *rows_index; /* Fenwick tree of rows taken by every subpath */
+    size_t rows;        /* Rows taken by subpaths when unfolded */
+    size_t pos;         /* Index in sorted subpaths of mainpath */
+    size_t order;
+    int sorted;
+    int indexed;
+    int hidden;         /* Hidden by the filter */
 } Path;
 
-typedef struct UnfoldedPaths {
-    PathLink *links;
-    size_t len;
-} UnfoldedPaths;
-
 enum SearchDir {
     SearchDirForward  = 1,
     SearchDirBackward = -1,
@@ -63,14 +65,36 @@ enum MatchStatus {
     MatchStatusErr,
 };
 
+Path *get_found_path(size_t i);
+Path *get_next_row_path(Path *path);
 Path *get_path_from_link(PathLink link);
+Path *get_row_path(size_t row);
+char *get_full_path(Path *path);
 enum MatchStatus path_match_pattern(Path *path);
+int filter_paths(int (*cancelled)(void));
+int find_paths(char *query, int (*cancelled)(void));
+int get_match_rank(Path *path, size_t *rank, size_t *count, int *complete);
 int init_paths_search(char *pattern, enum SearchDir dir);
-int search_path(PathLink *match, PathLink start, int invert_dir);
-size_t fold_path(UnfoldedPaths *unfolded_paths, size_t i);
-size_t get_paths(UnfoldedPaths *unfolded_paths, char **lines, size_t lines_l, char separator, PathState init_state);
-size_t unfold_path(UnfoldedPaths *unfolded_paths, size_t i);
-void free_paths(UnfoldedPaths unfolded_paths);
-void unfold_nested_path(UnfoldedPaths *unfolded_paths, Path *path, size_t *pos);
+int search_path(Path **match, Path *start, int invert_dir, int (*cancelled)(void));
+size_t add_paths(char **lines, size_t lines_l);
+size_t get_found_matches_count(void);
+size_t get_found_paths_count(void);
+size_t get_mainpath_row(Path *path, size_t row);
+size_t get_path_row(Path *path);
+size_t get_paths_count(void);
+size_t get_rows_count(void);
+size_t unfold_nested_path(Path *path);
+void continue_paths_search(void);
+void deinit_paths_find(void);
+void deinit_paths_search(void);
+void fold_path(Path *path);
+void free_paths(void);
+void init_paths(char separator, PathState init_state, unsigned jobs);
+void lock_paths(void);
+void sort_paths(void);
+void unfilter_paths(void);
+void unfold_path(Path *path);
+void unlock_paths(void);
+void update_paths_order(void);
 
 #endif
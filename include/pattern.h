@@ -0,0 +1,45 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <regex.h>
+#include <stdlib.h>
+
+#ifdef PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
+/* Compiled extended regular expression. Whatever backend is used, results
+ * are the same as regcomp() and regexec() return. */
+typedef struct Regex {
+#ifdef PCRE2
+    pcre2_code *code;
+#else
+    regex_t reg;
+#endif
+} Regex;
+
+int compile_regex(Regex *re, const char *pattern, int icase);
+int exec_regex(Regex *re, const char *s);
+void get_regex_error(Regex *re, int ret, char *buf, size_t size);
+void free_regex(Regex *re);
+
+#endif
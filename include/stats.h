@@ -0,0 +1,56 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdlib.h>
+
+#define STATS_LINE_LEN 64
+#define STATS_LINES_L  9
+
+typedef struct Timing {
+    long last_us;
+    long max_us;
+    long total_us;
+    size_t count;
+} Timing;
+
+/* Timings of the last frame and of the last fold and search, and totals
+ * since start */
+typedef struct Stats {
+    Timing input;
+    Timing draw;
+    Timing present;
+    Timing fold;
+    Timing search;
+    Timing find;
+    long written; /* Bytes written to the terminal by the last frame, -1 if unknown */
+    long total_written;
+    size_t frames;
+    size_t visible_paths_l;
+    size_t total_paths_l;
+} Stats;
+
+void record_timing(Timing *timing, long start_us);
+long get_written_bytes(void);
+void format_stats(Stats *stats, char lines[STATS_LINES_L][STATS_LINE_LEN]);
+int write_stats(const char *filename, Stats *stats);
+void close_stats(void);
+
+#endif
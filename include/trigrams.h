@@ -0,0 +1,37 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRIGRAMS_H
+#define TRIGRAMS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct TrigramIndexStats {
+    size_t paths_l; /* Number of paths that were indexed */
+    size_t size;    /* Memory taken by the index in bytes */
+    long time_ms;   /* Time it took to build the index */
+} TrigramIndexStats;
+
+int build_trigram_index(size_t paths_l, size_t max_size, int *stop);
+int get_trigram_candidates(const char *pattern, int literal, uint32_t **candidates,
+                           size_t *candidates_l, size_t *indexed_l);
+int get_trigram_index_stats(TrigramIndexStats *stats);
+void free_trigram_index(void);
+
+#endif
@@ -51,6 +51,15 @@ extern FILE *debug_file;
 #endif
 
 int size_t_compare(const void *a, const void *b);
+long get_time_ms(void);
+long get_time_us(void);
+unsigned get_cpu_count(void);
 size_t find_first_nonblank(char *string);
+int init_wakeup(void);
+int get_wakeup_fd(void);
+void wake_up(int signo);
+long get_wakeup_written(void);
+int read_wakeup(void);
+void deinit_wakeup(void);
 
 #endif
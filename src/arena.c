@@ -0,0 +1,106 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "arena.h"
+#include "vector.h"
+
+#define ARENA_ALIGN 16
+
+/* Allocations bigger than that get their own block */
+#define ARENA_MAX_SHARED (ARENA_BLOCK_SIZE / 4)
+
+static int is_power_of_two(size_t size)
+{
+    return size != 0 && (size & (size - 1)) == 0;
+}
+
+static int get_size_class(size_t size)
+{
+    return __builtin_ctzl(size);
+}
+
+static void *new_arena_block(Arena *arena, size_t size)
+{
+    char *block = malloc(size);
+    cvector_push_back(arena->blocks, block);
+    return block;
+}
+
+void *alloc_arena(Arena *arena, size_t size)
+{
+    void *ptr;
+    int c;
+
+    if (is_power_of_two(size) && size >= sizeof(void *)) {
+        c = get_size_class(size);
+        if (c < ARENA_SIZE_CLASSES && arena->recycled[c] != NULL) {
+            ptr = arena->recycled[c];
+            arena->recycled[c] = *(void **)ptr;
+            return ptr;
+        }
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (size > ARENA_MAX_SHARED)
+        return new_arena_block(arena, size);
+
+    if (size > arena->left) {
+        arena->ptr = new_arena_block(arena, ARENA_BLOCK_SIZE);
+        arena->left = ARENA_BLOCK_SIZE;
+    }
+
+    ptr = arena->ptr;
+    arena->ptr += size;
+    arena->left -= size;
+
+    return ptr;
+}
+
+/*
+ * Let a chunk of memory that is no longer used be reused. Chunks that
+ * can't be recycled stay allocated until the whole arena is freed.
+ */
+void recycle_arena(Arena *arena, void *ptr, size_t size)
+{
+    int c;
+
+    if (ptr == NULL || !is_power_of_two(size) || size < sizeof(void *))
+        return;
+
+    c = get_size_class(size);
+    if (c >= ARENA_SIZE_CLASSES)
+        return;
+
+    *(void **)ptr = arena->recycled[c];
+    arena->recycled[c] = ptr;
+}
+
+void free_arena(Arena *arena)
+{
+    if (arena->blocks != NULL) {
+        for (size_t i = 0; i < cvector_size(arena->blocks); i++) {
+            free(arena->blocks[i]);
+        }
+        cvector_free(arena->blocks);
+    }
+
+    memset(arena, 0, sizeof(*arena));
+}
@@ -18,6 +18,7 @@
 
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "args.h"
@@ -32,17 +33,22 @@
 
 static struct option long_opts[] = {
     { "fold",       no_argument,        NULL,  'f' },
+    { "index",      required_argument,  NULL,  'i' },
+    { "jobs",       required_argument,  NULL,  'j' },
     { "separator",  required_argument,  NULL,  's' },
+    { "stats",      required_argument,  NULL,  'S' },
     { "version",    no_argument,        NULL,  'v' },
     { "help",       no_argument,        NULL,  'h' },
     { 0,            0,                  NULL,  0   },
 };
 
-#define SHORT_OPTIONS "fs:vh"
+#define SHORT_OPTIONS "fi:j:s:S:vh"
 
 enum ArgAction process_args(Options *options, int argc, char **argv)
 {
     int c;
+    long jobs, index_size;
+    char *end;
 
     while (1) {
         c = getopt_long(argc, argv, SHORT_OPTIONS, long_opts, NULL);
@@ -56,6 +62,22 @@ enum ArgAction process_args(Options *options, int argc, char **argv)
         case 'f':
             options->init_paths_state = PathStateFolded;
             break;
+        case 'i':
+            index_size = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || index_size < 1) {
+                set_error("index size must be a positive integer");
+                return ArgActionErrorReport;
+            }
+            options->index_size = (size_t)index_size << 20;
+            break;
+        case 'j':
+            jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || jobs < 1) {
+                set_error("number of jobs must be a positive integer");
+                return ArgActionErrorReport;
+            }
+            options->jobs = jobs;
+            break;
         case 's':
             if (strlen(optarg) != 1) {
                 set_error("directory separator must a single character");
@@ -63,6 +85,9 @@ enum ArgAction process_args(Options *options, int argc, char **argv)
             }
             options->separator = optarg[0];
             break;
+        case 'S':
+            options->stats_file = optarg;
+            break;
         case 'v':
             puts(VERSION_MSG);
             return ArgActionExit;
@@ -23,7 +23,8 @@
 #include "error.h"
 #include "utils.h"
 
-static char error_buf[ERROR_BUF_SIZE];
+/* Every thread has its own error */
+static __thread char error_buf[ERROR_BUF_SIZE];
 
 void set_error(char *buf)
 {
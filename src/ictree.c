@@ -16,7 +16,14 @@
  * ictree. If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* wcwidth() is an X/Open function */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <locale.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,12 +31,16 @@
 #include <sys/wait.h>
 #include <termbox.h>
 #include <unistd.h>
+#include <wchar.h>
 
 #include "args.h"
 #include "config.h"
 #include "lines.h"
+#include "loader.h"
 #include "paths.h"
 #include "readline.h"
+#include "stats.h"
+#include "trigrams.h"
 #include "utils.h"
 
 #define SCREEN_X      tb_width()
@@ -40,7 +51,7 @@
 #define TREE_VIEW_TOP pager_pos.y
 #define TREE_VIEW_MID (pager_pos.y + (TREE_VIEW_Y / 2))
 #define TREE_VIEW_BOT (pager_pos.y + TREE_VIEW_Y - 1)
-#define MAX_PATHS     ((long)paths.len)
+#define MAX_PATHS     ((long)get_rows_count())
 
 #define INDENT               2
 #define ICON_STATUS_LEN      2
@@ -52,6 +63,21 @@
 #define PROMPT_LEFT_PAD  1
 #define PROMPT_RIGHT_PAD 1
 
+/* Width of the stats overlay */
+#define STATS_VIEW_X 53
+
+/* How long to wait for input before showing UI */
+#define LOADER_WAIT_MS 50
+
+/* How often to show new paths while input is loaded */
+#define LOADER_REFRESH_MS 100
+
+/* How long to wait for Esc before checking if search is done */
+#define SEARCH_POLL_MS 10
+
+/* Number of events that are kept while search is running */
+#define MAX_PENDING_EVENTS 64
+
 #define RETURN_ON_TB_ERROR(func_call, msg)                 \
     do {                                                   \
         int ret = (func_call);                             \
@@ -72,6 +98,26 @@ typedef struct Pos {
     long x, y;
 } Pos;
 
+typedef struct DrawnRow {
+    Path *path; /* NULL if the row is empty */
+    long x;
+    int fg;
+    int bg;
+    char *status_icon;
+} DrawnRow;
+
+typedef struct LineChar {
+    uint32_t ch;
+    int width;
+} LineChar;
+
+/* Line of a path decoded for drawing */
+typedef struct RowLine {
+    Path *path;
+    cvector_vector_type(LineChar) chars;
+    long width; /* Columns taken by the line */
+} RowLine;
+
 typedef enum UpdScrSignal {
     UpdScrSignalNo  = 0,
     UpdScrSignalYes = 1,
@@ -85,8 +131,21 @@ typedef struct PromptMsg {
 enum Mode {
     ModeNormal = 1,
     ModeSearch = 2,
+    ModeFind   = 3,
 };
 
+enum MotionType {
+    MotionNone,
+    MotionCursor,
+    MotionScroll,
+};
+
+/* Cursor movement or scrolling by a number of rows */
+typedef struct Motion {
+    enum MotionType type;
+    long rows;
+} Motion;
+
 enum State {
     StateRunning,
     StateStop,
@@ -103,71 +162,164 @@ static Options options;
 static FILE *stream = NULL;
 static int stream_file = 0;
 
-static Lines lines;
+static int loading = 1;
+static int indexing = 0;
+static long last_refresh_ms = 0;
+
+/* Whether matches of the search are still counted */
+static int counting_matches = 0;
+
+/* Path under the cursor the last time an event was handled. Rows move as
+ * paths are loaded, but the cursor stays on the same path. */
+static Path *selected_path = NULL;
 
-static UnfoldedPaths paths = { .links = NULL, .len = 0 };
 static size_t total_paths_l = 0;
 
 static enum SearchDir search_dir;
 static ReadlineCtx search_query;
 
+/* Path the cursor was on when the search prompt was opened and its
+ * distance from the top of the view. Search for the query that is being
+ * typed starts from it. */
+static Path *search_origin = NULL;
+static long search_origin_y;
+
+/* Whether the query was found while it was typed */
+static int search_found = 0;
+
+/* Directories that were unfolded to show a match of the query that is
+ * being typed. They are folded back when the query changes. */
+static cvector_vector_type(Path *) search_unfolded = NULL;
+
+/* Search that is restored when the search prompt is cancelled */
+static char last_search_query[READLINE_LINE_BUF_LEN] = "";
+static enum SearchDir last_search_dir;
+
+/* Query of the fuzzy finder, the selected match and the match on the
+ * top of the screen */
+static ReadlineCtx find_query;
+static long found_cursor = 0;
+static long found_top = 0;
+
+/* Whether only matches of the search are shown */
+static int filtered = 0;
+
+/* Events that came while search was running. They are handled after
+ * search is done. */
+static struct tb_event pending_events[MAX_PENDING_EVENTS];
+static int pending_events_l = 0;
+static int pending_events_i = 0;
+
 static Pos pager_pos = {0, 0};
 static long cursor_pos = 0;
 
+/* What is drawn on every row of the tree view, so rows that did not
+ * change are not drawn again */
+static cvector_vector_type(DrawnRow) drawn_rows = NULL;
+static enum Mode drawn_mode;
+
+/* Decoded lines of paths in view. A line is kept in a slot picked by the
+ * order of its path, so that lines of neighbouring rows don't evict each
+ * other and scrolling only decodes lines that come into view. */
+static RowLine *row_lines = NULL;
+static size_t row_lines_cap = 0;
+
+/* Whether the screen has to be drawn from scratch */
+static int screen_invalid = 1;
+
 static PromptMsg prompt_msg;
 
-static volatile enum State state;
+/* Timings of frames and whether they are shown over the tree view */
+static Stats stats = { .written = -1 };
+static int stats_shown = 0;
+
+static enum State state;
 
 static Command *command = NULL;
 
+static int check_loader(UpdScrSignal *upd);
+static int clear_row(int y);
 static int cleanup_termbox(void);
 static int draw(void);
+static int draw_found_paths(void);
+static int draw_row(int x, int y, int fg, int bg, char *status_icon, RowLine *line, long col_off);
+static int draw_stats(void);
+static int draw_tree(void);
+static int handle_event(struct tb_event *ev);
 static int fold(void);
 static int init_termbox(void);
+static int is_row_damaged(int y, DrawnRow row);
+static int is_same_motion(Motion a, Motion b);
+static int is_search_cancelled(void);
 static int is_search_result(Path *path);
 static int open_file(char *name);
 static int run(void);
 static int setup_signals(void);
 static int unfold(void);
 static int update_screen(void);
+static int wait_event(struct tb_event *ev);
 static UpdScrSignal goto_parent_or_fold(void);
 static UpdScrSignal goto_parent(void);
+static UpdScrSignal check_index(void);
 static UpdScrSignal handle_key(struct tb_event ev);
+static UpdScrSignal handle_key_loading(struct tb_event ev);
+static UpdScrSignal handle_motion(Motion motion);
 static UpdScrSignal handle_mouse_click(int x, int y);
 static UpdScrSignal handle_mouse(struct tb_event ev);
 static UpdScrSignal unfold_or_goto_child(void);
+static Motion get_motion(struct tb_event ev);
+static Path *get_cursor_path(void);
+static RowLine *get_row_line(Path *path);
+static void add_pending_motions(Motion *motion);
+static void cancel_search(void);
 static void catch_error(int signo);
 static void catch_stop(int signo);
 static void catch_term(int signo);
 static void center_cursor(void);
-static void cleanup_lines(void);
+static void cleanup_loader(void);
 static void cleanup_paths(void);
 static void cleanup(void);
 static void copy_path(void);
 static void cursor_move(int i);
 static void cursor_set(long p);
+static void find(void);
+static void format_matches(char *buf, size_t size);
+static void free_row_lines(void);
+static void goto_found_path(void);
+static void init_find(void);
 static void init_options(void);
 static void init_search(int dir);
 static void next_result(int invert_search);
 static void output_path(void);
 static void print_error(char *error_msg);
+static void quit_find(void);
 static void quit_search(void);
 static void quit(void);
+static void refold_search(void);
+static void refresh_paths(void);
+static void reserve_row_lines(size_t rows);
 static void reset_prompt_msg(void);
+static void return_to_search_origin(void);
 static void run_command(char *cmd);
 static void scroll_x(int i);
 static void scroll_y(int i);
 static void scroll_y_raw(int i);
 static void search(void);
+static void search_incrementally(void);
+static void select_cursor_path(void);
+static void select_found_path(long i);
 static void set_default_prompt(void);
+static void set_find_prompt(void);
 static void set_prompt_color(uint32_t fg, uint32_t bg);
 static void set_prompt_msg(char *msg);
 static void set_prompt_msg_err(char *msg);
 static void set_search_prompt(void);
 static void stop(void);
+static void toggle_filter(void);
 static void toggle_fold(void);
+static void toggle_stats(void);
+static void update_find_query(struct tb_event ev);
 static void update_search_query(struct tb_event ev);
-static void print_errorf(char *format, ...);
 static void set_prompt_msg_errf(char *format, ...);
 static void set_prompt_msgf(char *format, ...);
 
@@ -176,12 +328,14 @@ static void print_error(char *error_msg)
     fprintf(stderr, "%s: %s\n", program_path, error_msg);
 }
 
+#ifdef DEV
 static void print_errorf(char *format, ...)
 {
     char msg[ERROR_BUF_SIZE];
     FORMATTED_STRING(msg, format);
     print_error(msg);
 }
+#endif
 
 static void reset_prompt_msg(void)
 {
@@ -230,6 +384,9 @@ static void init_options(void)
     options.filename = NULL;
     options.init_paths_state = PathStateUnfolded;
     options.separator = '/';
+    options.jobs = get_cpu_count();
+    options.index_size = 0;
+    options.stats_file = NULL;
 }
 
 static void scroll_x(int i)
@@ -274,27 +431,25 @@ static void center_cursor(void)
     scroll_y_raw(cursor_pos - TREE_VIEW_MID);
 }
 
+static Path *get_cursor_path(void)
+{
+    return get_row_path(cursor_pos);
+}
+
 static UpdScrSignal goto_parent(void)
 {
-    Path *path = get_path_from_link(paths.links[cursor_pos]);
+    Path *path = get_cursor_path();
 
     if (!HAS_MAIN_PATH(*path))
         return UpdScrSignalNo;
 
-    for (long i = cursor_pos - 1; i >= 0; i--) {
-        if (PATH_LINKS_EQ(paths.links[i], path->mainpath)) {
-            cursor_set(i);
-            return UpdScrSignalYes;
-        }
-    }
-
-    /* If mainpath exists, it must always be found */
-    abort();
+    cursor_set(get_mainpath_row(path, cursor_pos));
+    return UpdScrSignalYes;
 }
 
 static int unfold(void)
 {
-    Path *p = get_path_from_link(paths.links[cursor_pos]);
+    Path *p = get_cursor_path();
     if (p->state == PathStateUnfolded) {
         return 0;
     }
@@ -302,25 +457,30 @@ static int unfold(void)
     if (p->subpaths_l <= 0)
         return 1;
 
-    unfold_path(&paths, cursor_pos);
+    long start_us = get_time_us();
+    unfold_path(p);
+    record_timing(&stats.fold, start_us);
 
     return 1;
 }
 
 static int fold(void)
 {
-    if (get_path_from_link(paths.links[cursor_pos])->state == PathStateFolded) {
+    Path *p = get_cursor_path();
+    if (p->state == PathStateFolded) {
         return 0;
     }
 
-    fold_path(&paths, cursor_pos);
+    long start_us = get_time_us();
+    fold_path(p);
+    record_timing(&stats.fold, start_us);
 
     return 1;
 }
 
 static void toggle_fold(void)
 {
-    switch (get_path_from_link(paths.links[cursor_pos])->state) {
+    switch (get_cursor_path()->state) {
     case PathStateFolded:
         assert(unfold() == 1);
         break;
@@ -332,7 +492,7 @@ static void toggle_fold(void)
 
 static UpdScrSignal goto_parent_or_fold(void)
 {
-    switch (get_path_from_link(paths.links[cursor_pos])->state) {
+    switch (get_cursor_path()->state) {
     case PathStateFolded:
         return goto_parent();
     case PathStateUnfolded:
@@ -344,14 +504,14 @@ static UpdScrSignal goto_parent_or_fold(void)
 
 static UpdScrSignal unfold_or_goto_child(void)
 {
-    Path *p = get_path_from_link(paths.links[cursor_pos]);
+    Path *p = get_cursor_path();
 
     switch (p->state) {
     case PathStateFolded:
         assert(unfold() == 1);
         return UpdScrSignalYes;
     case PathStateUnfolded:
-        if (p->subpaths_l > 0) {
+        if (p->rows > 0) {
             cursor_move(1);
             return UpdScrSignalYes;
         }
@@ -371,8 +531,8 @@ static void stop(void)
 
 static void output_path(void)
 {
-    Path *p = get_path_from_link(paths.links[cursor_pos]);
-    output_str = p->full_path;
+    Path *p = get_cursor_path();
+    output_str = strdup(get_full_path(p));
 
     quit();
 }
@@ -392,6 +552,9 @@ static void init_search(int dir)
     }
 
     mode = ModeSearch;
+    search_origin = MAX_PATHS > 0 ? get_cursor_path() : NULL;
+    search_origin_y = cursor_pos - pager_pos.y;
+    search_found = 0;
 
     set_search_prompt();
 }
@@ -405,15 +568,99 @@ static void quit_search(void)
 
 static void search(void)
 {
+    /* Directories unfolded to show the match stay unfolded */
+    cvector_set_size(search_unfolded, 0);
+
     if (search_query.line->len == 0)
         return;
 
-    if (init_paths_search(search_query.line->buf, search_dir) != 0) {
-        set_prompt_msg_err(get_error());
+    /* Search is only repeated if the query was not found as it was typed,
+     * so the error is shown */
+    if (!search_found) {
+        if (init_paths_search(search_query.line->buf, search_dir) != 0) {
+            set_prompt_msg_err(get_error());
+            return;
+        }
+
+        next_result(0);
+    }
+
+    strcpy(last_search_query, search_query.line->buf);
+    last_search_dir = search_dir;
+}
+
+/*
+ * Move the cursor to the nearest match of the query that is being typed.
+ * Highlighting is updated along with it.
+ */
+static void search_incrementally(void)
+{
+    int ret;
+    Path *result, *p;
+
+    search_found = 0;
+
+    if (search_origin == NULL)
+        return;
+
+    return_to_search_origin();
+
+    if (search_query.line->len == 0) {
+        deinit_paths_search();
+        return;
+    }
+
+    /* Incomplete patterns are not errors until Enter is pressed */
+    if (init_paths_search(search_query.line->buf, search_dir) != 0)
+        return;
+
+    /* Search is cancelled by the next key */
+    long start_us = get_time_us();
+    ret = search_path(&result, search_origin, 0, is_search_cancelled);
+    record_timing(&stats.search, start_us);
+    if (ret != 0 || result == NULL)
         return;
+
+    for (p = result;; p = get_path_from_link(p->mainpath)) {
+        if (p->state == PathStateFolded)
+            cvector_push_back(search_unfolded, p);
+        if (!HAS_MAIN_PATH(*p))
+            break;
     }
 
-    next_result(0);
+    cursor_set(unfold_nested_path(result));
+    search_found = 1;
+}
+
+static void refold_search(void)
+{
+    for (size_t i = 0; i < cvector_size(search_unfolded); i++)
+        fold_path(search_unfolded[i]);
+
+    cvector_set_size(search_unfolded, 0);
+}
+
+static void return_to_search_origin(void)
+{
+    long pos;
+
+    refold_search();
+
+    pos = get_path_row(search_origin);
+    pager_pos.y = pos - search_origin_y;
+    cursor_set(pos);
+}
+
+/*
+ * The cursor goes back to where it was and the last search is restored
+ */
+static void cancel_search(void)
+{
+    if (search_origin != NULL)
+        return_to_search_origin();
+
+    if (last_search_query[0] == '\0' || init_paths_search(last_search_query, last_search_dir) != 0)
+        deinit_paths_search();
 }
 
 static void update_search_query(struct tb_event ev)
@@ -434,6 +681,7 @@ static void update_search_query(struct tb_event ev)
             break;
         case TB_KEY_ESC:
             quit_search();
+            cancel_search();
             draw_s_prompt = 0;
             type = ReadlineClear;
             break;
@@ -463,31 +711,222 @@ static void update_search_query(struct tb_event ev)
     if (type >= 0)
         readline_send(&search_query, (ReadlineEvent){ .type = type, .ch = ch });
 
+    switch (type) {
+    case ReadlineType:
+    case ReadlineDelete:
+    case ReadlineBackspace:
+    case ReadlineHistUp:
+    case ReadlineHistDown:
+        search_incrementally();
+        break;
+    default:
+        break;
+    }
+
     if (draw_s_prompt)
         set_search_prompt();
 }
 
+static void init_find(void)
+{
+    mode = ModeFind;
+    find();
+}
+
+static void quit_find(void)
+{
+    mode = ModeNormal;
+    tb_hide_cursor();
+    set_default_prompt();
+    deinit_paths_find();
+}
+
+/*
+ * Rank paths by the fuzzy query. Ranking is cancelled by the next key,
+ * matches of the previous query are shown until then.
+ */
+static void find(void)
+{
+    long start_us = get_time_us();
+    int ret = find_paths(find_query.line->buf, is_search_cancelled);
+
+    record_timing(&stats.find, start_us);
+    if (ret == 0) {
+        found_cursor = 0;
+        found_top = 0;
+    }
+
+    set_find_prompt();
+}
+
+static void select_found_path(long i)
+{
+    found_cursor = MAX(0, MIN((long)get_found_paths_count() - 1, i));
+
+    if (found_cursor < found_top) {
+        found_top = found_cursor;
+    } else if (found_cursor >= found_top + TREE_VIEW_Y) {
+        found_top = found_cursor - TREE_VIEW_Y + 1;
+    }
+}
+
+static void goto_found_path(void)
+{
+    Path *p = get_found_path(found_cursor);
+
+    quit_find();
+
+    if (p != NULL)
+        cursor_set(unfold_nested_path(p));
+}
+
+static void update_find_query(struct tb_event ev)
+{
+    int type;
+
+    if (ev.ch) {
+        type = ReadlineType;
+    } else {
+        switch (ev.key) {
+        case TB_KEY_ENTER:
+            readline_send(&find_query, (ReadlineEvent){ .type = ReadlineEnter });
+            goto_found_path();
+            return;
+        case TB_KEY_ESC:
+            readline_send(&find_query, (ReadlineEvent){ .type = ReadlineClear });
+            quit_find();
+            return;
+        case TB_KEY_BACKSPACE2:
+            type = ReadlineBackspace;
+            break;
+        case TB_KEY_DELETE:
+            type = ReadlineDelete;
+            break;
+        case TB_KEY_ARROW_LEFT:
+            type = ReadlineCurLeft;
+            break;
+        case TB_KEY_ARROW_RIGHT:
+            type = ReadlineCurRight;
+            break;
+        case TB_KEY_ARROW_UP:
+        case TB_KEY_CTRL_P:
+            select_found_path(found_cursor - 1);
+            return;
+        case TB_KEY_ARROW_DOWN:
+        case TB_KEY_CTRL_N:
+            select_found_path(found_cursor + 1);
+            return;
+        default:
+            return;
+        }
+    }
+
+    readline_send(&find_query, (ReadlineEvent){ .type = type, .ch = ev.ch });
+
+    switch (type) {
+    case ReadlineType:
+    case ReadlineDelete:
+    case ReadlineBackspace:
+        find();
+        break;
+    default:
+        set_find_prompt();
+        break;
+    }
+}
+
+/*
+ * Show only matches of the search or all paths again. The cursor stays on
+ * its path if it's shown, otherwise it goes to the nearest match.
+ */
+static void toggle_filter(void)
+{
+    Path *p = get_cursor_path(), *result = NULL;
+    long y = cursor_pos - pager_pos.y, pos;
+
+    if (filtered) {
+        unfilter_paths();
+        filtered = 0;
+    } else {
+        if (filter_paths(is_search_cancelled) != 0) {
+            set_prompt_msg_err(get_error());
+            return;
+        }
+        filtered = 1;
+
+        /* Matches are shown, so there is one in either direction */
+        if (p->hidden) {
+            if (search_path(&result, p, 0, NULL) != 0 || result == NULL)
+                search_path(&result, p, 1, NULL);
+            p = result != NULL ? result : get_row_path(0);
+        }
+    }
+
+    /* Mainpaths that were unfolded by the filter might be folded back */
+    if (HAS_MAIN_PATH(*p))
+        unfold_nested_path(get_path_from_link(p->mainpath));
+
+    pos = get_path_row(p);
+    pager_pos.y = MAX(0, MIN(pos - y, MAX_PATHS - TREE_VIEW_Y));
+    cursor_set(pos);
+}
+
+/*
+ * Rows under the stats are drawn again once they are hidden
+ */
+static void toggle_stats(void)
+{
+    stats_shown = !stats_shown;
+    screen_invalid = 1;
+}
+
 static void next_result(int invert_search)
 {
     int ret;
-    Path *p;
-    PathLink result;
-    size_t pos;
+    Path *result;
 
-    ret = search_path(&result, paths.links[cursor_pos], invert_search);
+    long start_us = get_time_us();
+    ret = search_path(&result, get_cursor_path(), invert_search, is_search_cancelled);
+    record_timing(&stats.search, start_us);
     if (ret != 0) {
         set_prompt_msg_err(get_error());
         return;
     }
 
-    if (IS_NO_LINK(result)) {
+    if (result == NULL) {
         set_prompt_msg_errf("Pattern not found");
         return;
     }
 
-    p = get_path_from_link(result);
-    unfold_nested_path(&paths, p, &pos);
-    cursor_set(pos);
+    cursor_set(unfold_nested_path(result));
+}
+
+/*
+ * Search can be cancelled with Esc, unless MAX_PENDING_EVENTS events came
+ * before it. Other events are kept until search is done. While a query is
+ * typed, any key cancels search for it: the key is handled after, so the
+ * query changes anyway.
+ */
+static int is_search_cancelled(void)
+{
+    struct tb_event ev;
+
+    /* Events that don't fit are left in termbox until search is done. Wait
+     * as long as polling would, so search is not waited for in a busy loop. */
+    if (pending_events_l == MAX_PENDING_EVENTS) {
+        poll(NULL, 0, SEARCH_POLL_MS);
+        return 0;
+    }
+
+    if (tb_peek_event(&ev, SEARCH_POLL_MS) != TB_OK)
+        return 0;
+
+    if (ev.type == TB_EVENT_KEY && ev.key == TB_KEY_ESC && mode == ModeNormal)
+        return 1;
+
+    pending_events[pending_events_l++] = ev;
+
+    return mode != ModeNormal && ev.type == TB_EVENT_KEY;
 }
 
 static void set_search_prompt(void)
@@ -515,6 +954,17 @@ static void set_search_prompt(void)
     tb_set_cursor(search_query.cursor + 1 + PROMPT_LEFT_PAD, TREE_VIEW_Y + PROMPT_HEIGHT - 1);
 }
 
+static void set_find_prompt(void)
+{
+    char msg[PROMPT_MAX_LEN];
+    snprintf(msg, LENGTH(msg) - 1, "> %s", find_query.line->buf);
+
+    set_prompt_msg(msg);
+    set_prompt_color(TB_WHITE, TB_DEFAULT);
+
+    tb_set_cursor(find_query.cursor + 2 + PROMPT_LEFT_PAD, TREE_VIEW_Y + PROMPT_HEIGHT - 1);
+}
+
 static int is_search_result(Path *path)
 {
     enum MatchStatus st = path_match_pattern(path);
@@ -527,46 +977,185 @@ static int is_search_result(Path *path)
 
 static void set_default_prompt(void)
 {
-    set_prompt_msg(get_path_from_link(paths.links[cursor_pos])->full_path);
+    if (MAX_PATHS == 0) {
+        set_prompt_msg("");
+        return;
+    }
+
+    set_prompt_msg(get_full_path(get_cursor_path()));
 }
 
-static int draw(void)
+static int clear_row(int y)
 {
-    Path *path;
-    char *path_line, *status_icon;
+    for (int x = 0; x < TREE_VIEW_X; x++)
+        RETURN_ON_TB_ERROR(
+                tb_set_cell(x, y, ' ', TB_DEFAULT, TB_DEFAULT),
+                "failed to clear row");
+
+    return 0;
+}
+
+/*
+ * Check if a row has to be drawn and remember what is drawn on it
+ */
+static int is_row_damaged(int y, DrawnRow row)
+{
+    DrawnRow *d = &drawn_rows[y];
+
+    if (d->path == row.path && d->x == row.x && d->fg == row.fg && d->bg == row.bg
+            && d->status_icon == row.status_icon)
+        return 0;
+
+    *d = row;
+    return 1;
+}
+
+static void free_row_lines(void)
+{
+    for (size_t i = 0; i < row_lines_cap; i++) {
+        if (row_lines[i].chars != NULL)
+            cvector_free(row_lines[i].chars);
+    }
+
+    free(row_lines);
+    row_lines = NULL;
+    row_lines_cap = 0;
+}
+
+/*
+ * Make room for lines of twice as many rows, so that lines scrolled out of
+ * view stay until they are needed by other rows
+ */
+static void reserve_row_lines(size_t rows)
+{
+    size_t cap = 1;
+
+    while (cap < rows * 2)
+        cap *= 2;
+
+    if (cap <= row_lines_cap)
+        return;
+
+    free_row_lines();
+    row_lines = calloc(cap, sizeof(RowLine));
+    row_lines_cap = cap;
+}
+
+/*
+ * Get the line of a path decoded into characters and their widths. Lines
+ * don't change, so they are only decoded when their slot was taken by
+ * another path.
+ */
+static RowLine *get_row_line(Path *path)
+{
+    RowLine *line = &row_lines[path->order & (row_lines_cap - 1)];
+    char root[] = { options.separator, '\0' };
+    char *s = path->line;
+    uint32_t ch;
+    int i, len, width;
+
+    if (line->path == path)
+        return line;
+
+    line->path = path;
+    line->width = 0;
+    cvector_set_size(line->chars, 0);
+
+    if (*s == '\0')
+        s = root;
+
+    while (*s != '\0') {
+        /* Stray and truncated sequences are replaced byte by byte */
+        len = tb_utf8_char_length(*s);
+        for (i = 1; i < len && s[i] != '\0'; i++)
+            ;
+        if (i < len || ((unsigned char)*s >= 0x80 && len == 1)
+                || tb_utf8_char_to_unicode(&ch, s) < 0) {
+            ch = 0xfffd;
+            len = 1;
+        }
+
+        /* Termbox moves by one column past characters without width */
+        width = MAX(1, wcwidth(ch));
+
+        cvector_push_back(line->chars, ((LineChar){ ch, width }));
+        line->width += width;
+        s += len;
+    }
+
+    return line;
+}
+
+/*
+ * Draw the status icon at x and the line from column col_off. Wide
+ * characters cut by the left border are replaced by spaces.
+ */
+static int draw_row(int x, int y, int fg, int bg, char *status_icon, RowLine *line, long col_off)
+{
+    uint32_t ch;
+    long col = 0;
+    size_t i;
+
+    while (*status_icon != '\0') {
+        status_icon += tb_utf8_char_to_unicode(&ch, status_icon);
+        RETURN_ON_TB_ERROR(
+                tb_set_cell(x++, y, ch, fg, bg),
+                "failed to print status icon");
+    }
+
+    for (i = 0; i < cvector_size(line->chars) && col < col_off; i++)
+        col += line->chars[i].width;
+
+    for (; col > col_off; col_off++) {
+        RETURN_ON_TB_ERROR(
+                tb_set_cell(x++, y, ' ', fg, bg),
+                "failed to print path");
+    }
+
+    for (; i < cvector_size(line->chars) && x < TREE_VIEW_X; i++) {
+        RETURN_ON_TB_ERROR(
+                tb_set_cell(x, y, line->chars[i].ch, fg, bg),
+                "failed to print path");
+        x += line->chars[i].width;
+    }
+
+    return 0;
+}
+
+static int draw_tree(void)
+{
+    Path *path = NULL;
+    RowLine *line;
+    char *status_icon;
     int i, x, y, fg, bg;
-    long first_c_x;
-    unsigned long indent, char_off, subpaths_l;
+    long first_c_x, col_off;
+    unsigned long indent, subpaths_l;
 
-    /* Draw tree */
+    reserve_row_lines(TREE_VIEW_Y);
 
     for (y = 0; y < TREE_VIEW_Y; y++) {
         i = pager_pos.y + y;
 
-        if (i < 0) {
+        if (i < 0 || i >= MAX_PATHS) {
+            if (is_row_damaged(y, (DrawnRow){ .path = NULL }))
+                RETURN_ON_ERROR(clear_row(y));
             continue;
-        } else if (i >= MAX_PATHS) {
-            break;
         }
 
-        path = get_path_from_link(paths.links[i]);
+        path = path == NULL ? get_row_path(i) : get_next_row_path(path);
         subpaths_l = path->subpaths_l;
-        path_line = path->line;
         indent = path->depth * INDENT;
 
-        if (strlen(path_line) == 0)
-            path_line = (char []){ options.separator, '\0' };
-
         first_c_x = pager_pos.x - indent;
 
         /* If beginning of a line is to the left of the border of the screen,
          * chop the beginning of the line and print it from x=0.
          * Otherwise, just set x to the proper value. */
         if (first_c_x > 0) {
-            char_off = MIN(strlen(path_line), (unsigned)first_c_x);
+            col_off = first_c_x;
             x = 0;
         } else {
-            char_off = 0;
+            col_off = 0;
             x = -first_c_x;
         }
 
@@ -593,19 +1182,99 @@ static int draw(void)
             }
         }
 
-        RETURN_ON_TB_ERROR(
-                tb_printf(x, y, fg, bg, "%s%s", status_icon, path_line + char_off),
-                "failed to print path");
-        if (x + strlen(path->line) >= (unsigned long)TREE_VIEW_X)
-            RETURN_ON_TB_ERROR(
+        if (!is_row_damaged(y, (DrawnRow){ path, pager_pos.x, fg, bg, status_icon }))
+            continue;
+
+        line = get_row_line(path);
+        col_off = MIN(line->width, col_off);
+
+        RETURN_ON_ERROR(clear_row(y));
+        RETURN_ON_ERROR(draw_row(x, y, fg, bg, status_icon, line, col_off));
+        if (x + ICON_STATUS_LEN + line->width - col_off > TREE_VIEW_X)
+            RETURN_ON_TB_ERROR(
                     tb_set_cell(TREE_VIEW_X - 1, y, '>', TB_BLACK, TB_WHITE),
                     "failed to print '>' symbol");
+        if (col_off > 0)
+            RETURN_ON_TB_ERROR(
+                    tb_set_cell(0, y, '<', TB_BLACK, TB_WHITE),
+                    "failed to print '<' symbol");
+    }
+
+    return 0;
+}
+
+/*
+ * Show the best matches of the fuzzy finder. Ends of paths that don't fit
+ * are shown, since they are more important.
+ */
+static int draw_found_paths(void)
+{
+    Path *path;
+    char *full_path;
+    unsigned long len, char_off;
+    int y, fg, bg;
+
+    for (y = 0; y < TREE_VIEW_Y; y++) {
+        path = get_found_path(found_top + y);
+        if (path == NULL)
+            break;
+
+        full_path = get_full_path(path);
+        len = strlen(full_path);
+        char_off = len >= (unsigned long)TREE_VIEW_X ? len - TREE_VIEW_X + 1 : 0;
+
+        if (found_top + y == found_cursor) {
+            fg = TB_BLACK | TB_BOLD;
+            bg = TB_WHITE;
+        } else {
+            fg = TB_WHITE;
+            bg = TB_DEFAULT;
+        }
+
+        RETURN_ON_TB_ERROR(
+                tb_print(char_off > 0, y, fg, bg, full_path + char_off),
+                "failed to print path");
         if (char_off > 0)
             RETURN_ON_TB_ERROR(
                     tb_set_cell(0, y, '<', TB_BLACK, TB_WHITE),
                     "failed to print '<' symbol");
     }
 
+    return 0;
+}
+
+/*
+ * Format the number of matches of the search and the number of the match
+ * under the cursor
+ */
+static void format_matches(char *buf, size_t size)
+{
+    size_t rank, count;
+    int complete;
+
+    buf[0] = '\0';
+
+    if (get_match_rank(get_cursor_path(), &rank, &count, &complete) != 0)
+        return;
+
+    counting_matches = !complete;
+
+    if (rank > 0)
+        snprintf(buf, size, "match %zu of %zu   ", rank, count);
+    else
+        snprintf(buf, size, "%zu%s match%s   ", count, complete ? "" : "+", count == 1 ? "" : "es");
+}
+
+static int draw(void)
+{
+    int i, x, y, fg, bg;
+
+    if (mode == ModeFind) {
+        RETURN_ON_ERROR(draw_found_paths());
+    } else {
+        RETURN_ON_ERROR(draw_tree());
+    }
+
     /* Draw prompt */
 
     x = 0;
@@ -618,8 +1287,21 @@ static int draw(void)
             tb_print(x, y, fg, bg, prompt_msg.msg),
             "failed to print prompt message");
 
+    /* Only set while the count is shown, so it can't keep the loop awake */
+    counting_matches = 0;
+
     char ind[PROMPT_MAX_LEN];
-    snprintf(ind, PROMPT_MAX_LEN - PROMPT_RIGHT_PAD, "   %zu/%zu", paths.links[cursor_pos].index + 1, total_paths_l);
+    if (mode == ModeFind) {
+        snprintf(ind, PROMPT_MAX_LEN - PROMPT_RIGHT_PAD, "   %zu/%zu",
+                 get_found_matches_count(), get_paths_count());
+    } else if (loading) {
+        snprintf(ind, PROMPT_MAX_LEN - PROMPT_RIGHT_PAD, "   Loading %zu paths...", total_paths_l);
+    } else {
+        char matches[64];
+        format_matches(matches, LENGTH(matches));
+        snprintf(ind, PROMPT_MAX_LEN - PROMPT_RIGHT_PAD, "   %s%zu/%zu",
+                 matches, get_cursor_path()->order + 1, total_paths_l);
+    }
     for (i = 0; i < PROMPT_RIGHT_PAD; i++) {
        strncat(ind, " ", PROMPT_MAX_LEN - 1);
     }
@@ -629,20 +1311,86 @@ static int draw(void)
             tb_print(x, y, fg, bg, ind),
             "failed to print prompt message");
 
+    if (stats_shown)
+        RETURN_ON_ERROR(draw_stats());
+
+    return 0;
+}
+
+/*
+ * Draw stats of the last frame in the top right corner. Lines are padded,
+ * so that nothing is left of longer lines of the previous frame.
+ */
+static int draw_stats(void)
+{
+    char lines[STATS_LINES_L][STATS_LINE_LEN];
+    int x;
+
+    format_stats(&stats, lines);
+
+    x = MAX(0, TREE_VIEW_X - STATS_VIEW_X);
+    for (int y = 0; y < STATS_LINES_L && y < TREE_VIEW_Y; y++) {
+        RETURN_ON_TB_ERROR(
+                tb_printf(x, y, TB_BLACK, TB_WHITE, " %-*s", STATS_VIEW_X - 1, lines[y]),
+                "failed to print stats");
+    }
+
     return 0;
 }
 
+/*
+ * Draw what changed since the last time. Only rows of the tree view that
+ * show something else are drawn again, termbox only sends cells that
+ * changed to the terminal.
+ */
 static int update_screen(void)
 {
-    RETURN_ON_TB_ERROR(
-            tb_clear(),
-            "failed to clear screen");
+    int y;
+    long start_us, written;
+
+    /* Rows of the fuzzy finder are not tracked */
+    if (screen_invalid || mode == ModeFind || drawn_mode == ModeFind
+            || cvector_size(drawn_rows) != (size_t)TREE_VIEW_Y) {
+        RETURN_ON_TB_ERROR(
+                tb_clear(),
+                "failed to clear screen");
+
+        if (cvector_capacity(drawn_rows) < (size_t)TREE_VIEW_Y)
+            cvector_grow(drawn_rows, TREE_VIEW_Y);
+        cvector_set_size(drawn_rows, TREE_VIEW_Y);
+
+        /* No row matches an invalid icon */
+        for (y = 0; y < TREE_VIEW_Y; y++)
+            drawn_rows[y].status_icon = NULL;
+
+        screen_invalid = 0;
+    } else {
+        for (y = TREE_VIEW_Y; y < SCREEN_Y; y++)
+            RETURN_ON_ERROR(clear_row(y));
+    }
 
+    drawn_mode = mode;
+
+    stats.visible_paths_l = MAX_PATHS;
+    stats.total_paths_l = total_paths_l;
+
+    start_us = get_time_us();
     RETURN_ON_ERROR(draw());
+    record_timing(&stats.draw, start_us);
 
+    /* Reading /proc takes a syscall, so it's only done if stats are used */
+    written = stats_shown || options.stats_file != NULL ? get_written_bytes() : -1;
+    start_us = get_time_us();
     RETURN_ON_TB_ERROR(
         tb_present(),
         "failed to synchronize the internal buffer with the terminal");
+    record_timing(&stats.present, start_us);
+
+    /* Only the terminal is written to while the screen is drawn, apart from
+     * the files of DEV builds */
+    stats.written = written < 0 ? -1 : get_written_bytes() - written;
+    stats.total_written += MAX(0, stats.written);
+    stats.frames++;
 
     return 0;
 }
@@ -658,11 +1406,19 @@ static int update_screen(void)
 
 static UpdScrSignal handle_key(struct tb_event ev)
 {
+    if (MAX_PATHS == 0)
+        return handle_key_loading(ev);
+
     if (mode == ModeSearch) {
         update_search_query(ev);
         return UpdScrSignalYes;
     }
 
+    if (mode == ModeFind) {
+        update_find_query(ev);
+        return UpdScrSignalYes;
+    }
+
     for (Command *cmd = command; cmd; cmd = cmd->next) {
         if (ev.ch == (uint32_t)cmd->ch) {
             run_command(cmd->cmd);
@@ -699,6 +1455,10 @@ static UpdScrSignal handle_key(struct tb_event ev)
         CONTROL_ACTION(cursor_set(MAX_PATHS - 1));
     case TB_KEY_ENTER:
         CONTROL_ACTION(toggle_fold());
+    case TB_KEY_CTRL_T:
+        CONTROL_ACTION(init_find());
+    case TB_KEY_CTRL_G:
+        CONTROL_ACTION(toggle_stats());
     case TB_KEY_CTRL_Z:
         CONTROL_ACTION(raise(SIGTSTP));
     case TB_KEY_ESC:
@@ -740,6 +1500,8 @@ static UpdScrSignal handle_key(struct tb_event ev)
         CONTROL_ACTION(next_result(0));
     case 'N':
         CONTROL_ACTION(next_result(1));
+    case 'f':
+        CONTROL_ACTION(toggle_filter());
     case 'y':
         CONTROL_ACTION(copy_path());
     case 'o':
@@ -749,8 +1511,32 @@ static UpdScrSignal handle_key(struct tb_event ev)
     return UpdScrSignalNo;
 }
 
+/*
+ * There are no paths to work with until input is loaded, so only the
+ * commands that do not need them are available
+ */
+static UpdScrSignal handle_key_loading(struct tb_event ev)
+{
+    switch (ev.key) {
+    case TB_KEY_CTRL_Z:
+        CONTROL_ACTION(raise(SIGTSTP));
+    case TB_KEY_ESC:
+        CONTROL_ACTION(quit());
+    }
+
+    switch (ev.ch) {
+    case 'q':
+        CONTROL_ACTION(quit());
+    }
+
+    return UpdScrSignalNo;
+}
+
 static UpdScrSignal handle_mouse(struct tb_event ev)
 {
+    if (MAX_PATHS == 0 || mode == ModeFind)
+        return UpdScrSignalNo;
+
     switch (ev.key) {
     case TB_KEY_MOUSE_LEFT:
         return handle_mouse_click(ev.x, ev.y);
@@ -775,6 +1561,111 @@ static UpdScrSignal handle_mouse_click(int x, int y)
     return UpdScrSignalYes;
 }
 
+/*
+ * Single-row movement of the cursor or the view. Keys bound to commands
+ * and events outside of the tree view don't move anything.
+ */
+static Motion get_motion(struct tb_event ev)
+{
+    Motion none = { .type = MotionNone, .rows = 0 };
+
+    if (MAX_PATHS == 0 || mode != ModeNormal)
+        return none;
+
+    if (ev.type == TB_EVENT_MOUSE) {
+        switch (ev.key) {
+        case TB_KEY_MOUSE_WHEEL_DOWN:
+            return (Motion){ .type = MotionScroll, .rows = SCROLL_Y };
+        case TB_KEY_MOUSE_WHEEL_UP:
+            return (Motion){ .type = MotionScroll, .rows = -SCROLL_Y };
+        }
+        return none;
+    }
+
+    if (ev.type != TB_EVENT_KEY)
+        return none;
+
+    for (Command *cmd = command; cmd; cmd = cmd->next) {
+        if (ev.ch == (uint32_t)cmd->ch)
+            return none;
+    }
+
+    switch (ev.key) {
+    case TB_KEY_CTRL_E:
+        return (Motion){ .type = MotionScroll, .rows = SCROLL_Y };
+    case TB_KEY_CTRL_Y:
+        return (Motion){ .type = MotionScroll, .rows = -SCROLL_Y };
+    case TB_KEY_ARROW_DOWN:
+        return (Motion){ .type = MotionCursor, .rows = 1 };
+    case TB_KEY_ARROW_UP:
+        return (Motion){ .type = MotionCursor, .rows = -1 };
+    }
+
+    switch (ev.ch) {
+    case 'j':
+        return (Motion){ .type = MotionCursor, .rows = 1 };
+    case 'k':
+        return (Motion){ .type = MotionCursor, .rows = -1 };
+    }
+
+    return none;
+}
+
+static int is_same_motion(Motion a, Motion b)
+{
+    return a.type == b.type && (a.rows > 0) == (b.rows > 0);
+}
+
+/*
+ * Add up motions of the same kind and direction that are already waiting,
+ * so that a held key or a spinning wheel is drawn once per batch instead
+ * of once per event. The first other event is handled next.
+ */
+static void add_pending_motions(Motion *motion)
+{
+    struct tb_event ev;
+    Motion next;
+
+    while (1) {
+        if (pending_events_i < pending_events_l) {
+            next = get_motion(pending_events[pending_events_i]);
+            if (!is_same_motion(next, *motion))
+                return;
+            pending_events_i++;
+        } else {
+            if (tb_peek_event(&ev, 0) != TB_OK)
+                return;
+            next = get_motion(ev);
+            if (!is_same_motion(next, *motion)) {
+                pending_events[0] = ev;
+                pending_events_i = 0;
+                pending_events_l = 1;
+                return;
+            }
+        }
+
+        motion->rows += next.rows;
+    }
+}
+
+/*
+ * Moving by several rows at once stops at the first or the last path, the
+ * same as moving row by row does
+ */
+static UpdScrSignal handle_motion(Motion motion)
+{
+    long rows;
+
+    if (motion.type == MotionScroll)
+        pager_pos.y = MAX(0, MIN(MAX_PATHS - TREE_VIEW_Y, pager_pos.y + motion.rows));
+
+    rows = MAX(-cursor_pos, MIN(MAX_PATHS - 1 - cursor_pos, motion.rows));
+    if (rows != 0)
+        cursor_move(rows);
+
+    return UpdScrSignalYes;
+}
+
 #define SETUP_SIGNAL(sig, fun)                            \
     do {                                                  \
         if (signal(sig, fun) == SIG_ERR) {                \
@@ -800,14 +1691,18 @@ static void catch_error(int signo)
         print_error(get_error());
 }
 
+/*
+ * Signals are handled by the main loop, so the state only changes between
+ * events
+ */
 static void catch_term(int signo)
 {
-    quit();
+    wake_up(signo);
 }
 
 static void catch_stop(int signo)
 {
-    stop();
+    wake_up(signo);
 }
 
 #define FAILED_TO_RUN_CMD_ERR_MSG "Failed to run command: "
@@ -819,8 +1714,8 @@ static void run_command(char *cmd)
         return;
     }
 
-    Path *p = get_path_from_link(paths.links[cursor_pos]);
-    char *full_path = p->full_path;
+    Path *p = get_cursor_path();
+    char *full_path = get_full_path(p);
 
     int err_p[2];
     if (pipe(err_p) == -1) {
@@ -925,8 +1820,8 @@ static void copy_path(void)
     close(fd_r);
 
     int status;
-    Path *p = get_path_from_link(paths.links[cursor_pos]);
-    full_path = p->full_path;
+    Path *p = get_cursor_path();
+    full_path = get_full_path(p);
 
     if (write(fd_w, full_path, strlen(full_path) + 1) == -1) {
         set_prompt_msg_err(FAILED_TO_COPY_ERR_MSG "write() failed");
@@ -953,40 +1848,144 @@ static void copy_path(void)
     set_prompt_msgf("Copied: %s", full_path);
 }
 
+/*
+ * Handle a termbox event if there is one and check if new paths were loaded
+ */
+static int handle_event(struct tb_event *ev)
+{
+    UpdScrSignal upd = UpdScrSignalNo;
+    long start_us;
+
+    if (loading)
+        refresh_paths();
+
+    /* Scanners wake up the loop when they are done */
+    continue_paths_search();
+
+    if (ev != NULL) {
+        Motion motion = get_motion(*ev);
+
+        switch (ev->type) {
+        case TB_EVENT_KEY:
+        case TB_EVENT_MOUSE:
+            start_us = get_time_us();
+            if (motion.type != MotionNone) {
+                add_pending_motions(&motion);
+                upd = handle_motion(motion);
+            } else if (ev->type == TB_EVENT_KEY) {
+                upd = handle_key(*ev);
+            } else {
+                upd = handle_mouse(*ev);
+            }
+            record_timing(&stats.input, start_us);
+            break;
+        case TB_EVENT_RESIZE:
+            screen_invalid = 1;
+            upd = UpdScrSignalYes;
+            break;
+        }
+    }
+
+    if (loading) {
+        UpdScrSignal loader_upd;
+        RETURN_ON_ERROR(check_loader(&loader_upd));
+        if (loader_upd == UpdScrSignalYes)
+            upd = UpdScrSignalYes;
+    }
+
+    if (indexing && !loading && check_index() == UpdScrSignalYes)
+        upd = UpdScrSignalYes;
+
+    if (counting_matches && get_time_ms() - last_refresh_ms >= LOADER_REFRESH_MS) {
+        last_refresh_ms = get_time_ms();
+        upd = UpdScrSignalYes;
+    }
+
+    if (upd == UpdScrSignalYes)
+        RETURN_ON_ERROR(update_screen());
+
+    if (loading)
+        select_cursor_path();
+
+    return 0;
+}
+
+/*
+ * Block until there is input, a signal or news from other threads.
+ * Returns the same values as tb_peek_event().
+ */
+static int wait_event(struct tb_event *ev)
+{
+    struct pollfd fds[3];
+    int ret;
+
+    /* Termbox may have read several events at once */
+    if ((ret = tb_peek_event(ev, 0)) != TB_ERR_NO_EVENT)
+        return ret;
+
+    tb_get_fds(&fds[0].fd, &fds[1].fd);
+    fds[2].fd = get_wakeup_fd();
+    for (size_t i = 0; i < LENGTH(fds); i++)
+        fds[i].events = POLLIN;
+
+    /* Loaded paths and counted matches are shown as they come */
+    if (poll(fds, LENGTH(fds), loading || counting_matches ? LOADER_REFRESH_MS : -1) == -1)
+        return errno == EINTR ? TB_ERR_NO_EVENT : TB_ERR_POLL;
+
+    if (fds[2].revents & POLLIN) {
+        switch (read_wakeup()) {
+        case SIGINT:
+        case SIGTERM:
+            quit();
+            break;
+        case SIGTSTP:
+            stop();
+            break;
+        }
+    }
+
+    if (state != StateRunning)
+        return TB_ERR_NO_EVENT;
+
+    return tb_peek_event(ev, 0);
+}
+
 static int run(void)
 {
     int ret;
     struct tb_event ev;
 
+    lock_paths();
     set_default_prompt();
+    ret = update_screen();
+    select_cursor_path();
+    unlock_paths();
 
-    RETURN_ON_ERROR(update_screen());
+    RETURN_ON_ERROR(ret);
 
     while (1) {
-        ret = tb_peek_event(&ev, 10);
-        if (ret == TB_OK) {
-            switch (ev.type) {
-            case TB_EVENT_KEY:
-                if (handle_key(ev) == UpdScrSignalYes) {
-                    RETURN_ON_ERROR(update_screen());
-                }
-                break;
-            case TB_EVENT_MOUSE:
-                if (handle_mouse(ev) == UpdScrSignalYes) {
-                    RETURN_ON_ERROR(update_screen());
-                }
-                break;
-            case TB_EVENT_RESIZE:
-                RETURN_ON_ERROR(update_screen());
-                break;
-            }
-        } else if (ret == TB_ERR_POLL && tb_last_errno() == EINTR) {
+        if (pending_events_i < pending_events_l) {
+            ev = pending_events[pending_events_i++];
+            ret = TB_OK;
+        } else {
+            pending_events_i = pending_events_l = 0;
+            ret = wait_event(&ev);
+        }
+
+        if (ret == TB_ERR_POLL && tb_last_errno() == EINTR) {
             continue;
-        } else if (ret != TB_ERR_NO_EVENT) {
+        } else if (ret != TB_OK && ret != TB_ERR_NO_EVENT) {
             set_errorf("failed to poll termbox event: %s", tb_strerror(ret));
             return 1;
         }
 
+        /* The loader must not change paths while they are used */
+        lock_paths();
+        ret = handle_event(ret == TB_OK ? &ev : NULL);
+        unlock_paths();
+
+        RETURN_ON_ERROR(ret);
+
         if (state != StateRunning) {
             break;
         }
@@ -995,6 +1994,97 @@ static int run(void)
     return 0;
 }
 
+static void select_cursor_path(void)
+{
+    selected_path = MAX_PATHS > 0 ? get_cursor_path() : NULL;
+}
+
+/*
+ * Paths that were loaded since the last event might have moved the
+ * selected path to another row. Move the cursor after it, so that it stays
+ * at the same place on the screen.
+ */
+static void refresh_paths(void)
+{
+    long pos;
+
+    if (selected_path == NULL) {
+        if (MAX_PATHS > 0 && mode == ModeNormal)
+            set_default_prompt();
+        return;
+    }
+
+    /* The selected path is still visible since nothing was folded */
+    pos = get_path_row(selected_path);
+
+    scroll_y_raw(pos - cursor_pos);
+    cursor_pos = pos;
+}
+
+/*
+ * Show paths that were loaded so far. Must be called with paths locked.
+ */
+static int check_loader(UpdScrSignal *upd)
+{
+    LoaderStatus st = get_loader_status();
+
+    *upd = UpdScrSignalNo;
+
+    switch (st.state) {
+    case LoaderStateError:
+        return 1;
+    case LoaderStateReading:
+        if (st.paths_l != total_paths_l) {
+            total_paths_l = st.paths_l;
+            if (MAX_PATHS == 0 || get_time_ms() - last_refresh_ms >= LOADER_REFRESH_MS) {
+                last_refresh_ms = get_time_ms();
+                refresh_paths();
+                *upd = UpdScrSignalYes;
+            }
+        }
+        return 0;
+    case LoaderStateDone:
+        break;
+    }
+
+    if (st.paths_l == 0) {
+        set_errorf("%s seems to be empty", stream_file ? "file" : "input");
+        return 1;
+    }
+
+    total_paths_l = st.paths_l;
+    loading = 0;
+    refresh_paths();
+
+    *upd = UpdScrSignalYes;
+    return 0;
+}
+
+/*
+ * Report the trigram index once it is built. Must be called with paths
+ * locked.
+ */
+static UpdScrSignal check_index(void)
+{
+    TrigramIndexStats st;
+
+    if (get_trigram_index_stats(&st) != 0)
+        return UpdScrSignalNo;
+
+    indexing = 0;
+    if (mode != ModeNormal)
+        return UpdScrSignalNo;
+
+    if (st.paths_l < total_paths_l)
+        set_prompt_msgf("Indexed %zu of %zu paths in %.2f s (%.1f MiB)", st.paths_l,
+                        total_paths_l, st.time_ms / 1000.0, st.size / 1048576.0);
+    else
+        set_prompt_msgf("Indexed %zu paths in %.2f s (%.1f MiB)", st.paths_l,
+                        st.time_ms / 1000.0, st.size / 1048576.0);
+
+    return UpdScrSignalYes;
+}
+
 static int open_file(char *name)
 {
     int ret;
@@ -1023,6 +2113,7 @@ static int init_termbox(void)
 
     tb_set_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
     tb_hide_cursor();
+    screen_invalid = 1;
 
     state = StateRunning;
     return 0;
@@ -1039,26 +2130,38 @@ static int cleanup_termbox(void)
     return 1;
 }
 
-static void cleanup_lines(void)
+static void cleanup_loader(void)
 {
-    free_lines(&lines);
+    stop_loader();
 }
 
 static void cleanup_paths(void)
 {
-    free_paths(paths);
+    free_paths();
 }
 
 static void cleanup(void)
 {
     cleanup_termbox();
+    cleanup_loader();
     cleanup_paths();
-    cleanup_lines();
     if (stream_file) {
         fclose(stream);
     }
     cleanup_readline_ctx(&search_query);
+    cleanup_readline_ctx(&find_query);
+    if (search_unfolded != NULL) {
+        cvector_free(search_unfolded);
+        search_unfolded = NULL;
+    }
+    if (drawn_rows != NULL) {
+        cvector_free(drawn_rows);
+        drawn_rows = NULL;
+    }
+    free_row_lines();
     free_command(command);
+    deinit_wakeup();
+    close_stats();
 #ifdef DEV
     if (debug_file != NULL)
         fclose(debug_file);
@@ -1069,6 +2172,9 @@ int main(int argc, char *argv[])
 {
     int ret;
     program_path = argc >= 1 ? argv[0] : "ictree";
+
+    /* Widths of characters depend on the locale */
+    setlocale(LC_CTYPE, "");
     stream = stdin;
 
     init_options();
@@ -1097,6 +2203,14 @@ int main(int argc, char *argv[])
     }
 
     init_readline_ctx(&search_query);
+    init_readline_ctx(&find_query);
+
+    /* Other threads and signals wake up the main loop through a pipe */
+    if (init_wakeup() != 0) {
+        print_error(get_error());
+        cleanup();
+        return EXIT_FAILURE;
+    }
 
 #ifdef DEV
     debug_file = fopen(DEBUG_FILE, "w");
@@ -1106,18 +2220,28 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    /* Get and process input */
-    lines = get_lines(stream, options.separator);
-
-    if (lines.lines_l <= 0) {
-        char *s = stream_file ? "file" : "input";
-        print_errorf("%s seems to be empty", s);
+    /* Get and process input in background */
+    if (start_loader(stream, options.separator, options.init_paths_state, options.jobs,
+                     options.index_size) != 0) {
+        print_error(get_error());
         cleanup();
         return EXIT_FAILURE;
     }
+    indexing = options.index_size > 0;
 
-    sort_lines(lines);
-    total_paths_l = get_paths(&paths, lines.lines, lines.lines_l, options.separator, options.init_paths_state);
+    /* Small inputs are loaded before UI is shown */
+    wait_loader(LOADER_WAIT_MS);
+
+    UpdScrSignal upd;
+    lock_paths();
+    ret = check_loader(&upd);
+    unlock_paths();
+
+    if (ret != 0) {
+        print_error(get_error());
+        cleanup();
+        return EXIT_FAILURE;
+    }
 
     if (setup_signals() != 0) {
         cleanup();
@@ -1148,8 +2272,12 @@ init_tb:
     if (output_str != NULL) {
         cleanup_termbox();
         puts(output_str);
+        free(output_str);
     }
 
+    if (ret == 0 && options.stats_file != NULL)
+        ret = write_stats(options.stats_file, &stats);
+
     cleanup();
 
     if (ret != 0) {
@@ -16,9 +16,13 @@
  * ictree. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "lines.h"
@@ -27,79 +31,196 @@
 
 #define MIN_LINES_VECTOR_LEN 256
 
-static char *get_line(FILE *stream)
+/*
+ * Allocate a new block for input and move unfinished line to it.
+ * Lines that are already in the current block stay where they are.
+ */
+static char *new_block(Lines *l, char *block, size_t *len, size_t *line_start, size_t *size)
 {
-    int c;
+    size_t tail = *len - *line_start;
+    size_t new_size = MAX(READ_BLOCK_SIZE, tail * 2);
+    char *b;
+
+    if (block != NULL && *line_start == 0) {
+        /* No lines point into the block: it can be safely reallocated */
+        b = realloc(block, new_size);
+        l->blocks[cvector_size(l->blocks) - 1] = b;
+    } else {
+        b = malloc(new_size);
+        if (tail > 0)
+            memcpy(b, block + *line_start, tail);
+        cvector_push_back(l->blocks, b);
+    }
 
-    cvector_vector_type(char) s = NULL;
+    *len = tail;
+    *line_start = 0;
+    *size = new_size;
+    return b;
+}
+
+/*
+ * Split data in [p, end) into lines. Delimiters are replaced with '\0' so
+ * that every line becomes a separate string. Returns the beginning of the
+ * last unfinished line.
+ */
+static char *split_lines(Lines *l, char *line, char *p, char *end)
+{
+    while ((p = memchr(p, LINE_DELIM, end - p)) != NULL) {
+        *p++ = '\0';
+        cvector_push_back(l->lines, line);
+        line = p;
+    }
 
-    do {
-        c = fgetc(stream);
+    return line;
+}
 
-        if (feof(stream) || c == LINE_DELIM) {
-            c = 0;
-        }
+/*
+ * Pass new lines to the callback. Lines are only kept until it returns.
+ */
+static void report_lines(Lines *l, LinesCallback callback)
+{
+    l->lines_l = cvector_size(l->lines);
 
-        cvector_push_back(s, c);
-    } while (c);
+    if (callback == NULL)
+        return;
 
-    return s;
+    callback(l);
+    cvector_set_size(l->lines, 0);
+    l->lines_l = 0;
 }
 
-Lines get_lines(FILE *stream, char separator)
+static int read_lines(Lines *l, int fd, LinesCallback callback)
 {
-    char *s;
+    char *block = NULL;
+    size_t size = 0, len = 0, line_start = 0;
+    ssize_t n;
 
-    Lines l = { .lines = NULL, .lines_l = 0 };
+    while (1) {
+        if (len == size)
+            block = new_block(l, block, &len, &line_start, &size);
+
+        n = read(fd, block + len, size - len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            set_errorf("failed to read input: %s", strerror(errno));
+            return 1;
+        } else if (n == 0) {
+            break;
+        }
 
-    /* lines vector contains pointers to every line */
-    cvector_grow(l.lines, MIN_LINES_VECTOR_LEN);
+        line_start = split_lines(l, block + line_start, block + len, block + len + n) - block;
+        len += n;
 
-    while (1) {
-        s = get_line(stream);
+        report_lines(l, callback);
+    }
 
-        /* Append / char if not already there */
-        if (s[cvector_size(s) - 2] != separator) {
-            cvector_pop_back(s); /* Remove '\0' */
-            cvector_push_back(s, separator);
-            cvector_push_back(s, 0);
-        }
+    /* Last line is not terminated with LINE_DELIM */
+    if (line_start < len) {
+        if (len == size)
+            block = new_block(l, block, &len, &line_start, &size);
+        block[len] = '\0';
+        cvector_push_back(l->lines, block + line_start);
+        report_lines(l, callback);
+    }
+
+    return 0;
+}
 
-        if (feof(stream)) {
-            cvector_free(s);
+/*
+ * Read a regular file into one buffer of its size, so lines never have to be
+ * moved to a new block. The file itself is not mapped: terminating lines in
+ * place would make almost every page a private copy anyway, and lines would
+ * fault with SIGBUS if the file was truncated.
+ */
+static int read_file_lines(Lines *l, int fd, size_t size, LinesCallback callback)
+{
+    char *map, *line;
+    size_t page = sysconf(_SC_PAGESIZE), len = 0;
+    ssize_t n;
+
+    /* Reserve one extra byte after the end of the file, so the last line
+     * can be terminated even if the file size is a multiple of page size */
+    size_t map_l = (size + page) / page * page;
+
+    map = mmap(NULL, map_l, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return read_lines(l, fd, callback);
+
+    l->map = map;
+    l->map_l = map_l;
+
+    /* Read the file in blocks to report progress. It may be truncated
+     * meanwhile, then only what is left is read. */
+    line = map;
+    while (len < size) {
+        n = read(fd, map + len, MIN(READ_BLOCK_SIZE, size - len));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            set_errorf("failed to read input: %s", strerror(errno));
+            return 1;
+        } else if (n == 0) {
             break;
         }
 
-        cvector_push_back(l.lines, s);
+        line = split_lines(l, line, map + len, map + len + n);
+        len += n;
+
+        report_lines(l, callback);
+    }
+
+    /* Bytes past the end of the file are zeroed */
+    if (line < map + len) {
+        cvector_push_back(l->lines, line);
+        report_lines(l, callback);
     }
 
-    l.lines_l = cvector_size(l.lines);
-    return l;
+    return 0;
+}
+
+int get_lines(Lines *l, FILE *stream, char separator, LinesCallback callback)
+{
+    int fd = fileno(stream);
+    struct stat st;
+
+    l->lines = NULL;
+    l->lines_l = 0;
+    l->blocks = NULL;
+    l->map = NULL;
+    l->map_l = 0;
+    l->separator = separator;
+
+    /* lines vector contains pointers to every line */
+    cvector_grow(l->lines, MIN_LINES_VECTOR_LEN);
+
+    /* Size of regular files is known, everything else is read in blocks */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+            && lseek(fd, 0, SEEK_CUR) == 0)
+        return read_file_lines(l, fd, st.st_size, callback);
+
+    return read_lines(l, fd, callback);
 }
 
 void free_lines(Lines *lines)
 {
     if (lines->lines != NULL) {
-        for (size_t i = 0; i < cvector_size(lines->lines); i++) {
-            cvector_free(lines->lines[i]);
-        }
         cvector_free(lines->lines);
         lines->lines = NULL;
         lines->lines_l = 0;
     }
-}
-
-static int line_compare(const void *a, const void *b)
-{
-    char *line1 = *(char **)a, *line2 = *(char **)b;
 
-    line1 += find_first_nonblank(line1);
-    line2 += find_first_nonblank(line2);
-
-    return strcmp(line1, line2);
-}
+    if (lines->blocks != NULL) {
+        for (size_t i = 0; i < cvector_size(lines->blocks); i++) {
+            free(lines->blocks[i]);
+        }
+        cvector_free(lines->blocks);
+        lines->blocks = NULL;
+    }
 
-void sort_lines(Lines lines)
-{
-    qsort(lines.lines, lines.lines_l, sizeof(lines.lines[0]), line_compare);
+    if (lines->map != NULL) {
+        munmap(lines->map, lines->map_l);
+        lines->map = NULL;
+        lines->map_l = 0;
+    }
 }
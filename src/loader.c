@@ -0,0 +1,201 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "lines.h"
+#include "loader.h"
+#include "paths.h"
+#include "trigrams.h"
+#include "utils.h"
+
+typedef struct Loader {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE *stream;
+    char separator;
+    LoaderStatus status;
+    char error[ERROR_BUF_SIZE];
+    size_t lines_l;
+    size_t index_size;
+    int stop;
+    int started;
+} Loader;
+
+static Loader loader = {
+    .lock    = PTHREAD_MUTEX_INITIALIZER,
+    .cond    = PTHREAD_COND_INITIALIZER,
+    .started = 0,
+};
+
+static Lines lines;
+
+static void set_status(LoaderState state, size_t paths_l)
+{
+    pthread_mutex_lock(&loader.lock);
+    loader.status.state = state;
+    loader.status.lines_l = loader.lines_l;
+    loader.status.paths_l = paths_l;
+    if (state == LoaderStateError)
+        strncpy(loader.error, get_error(), ERROR_BUF_SIZE);
+    pthread_cond_broadcast(&loader.cond);
+    pthread_mutex_unlock(&loader.lock);
+
+    wake_up(0);
+}
+
+/*
+ * Insert new lines into the tree as soon as they are read
+ */
+static void add_lines(Lines *l)
+{
+    size_t paths_l;
+    int state;
+
+    /* Paths must not be left locked */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    lock_paths();
+    paths_l = add_paths(l->lines, l->lines_l);
+    unlock_paths();
+    pthread_setcancelstate(state, NULL);
+
+    loader.lines_l += l->lines_l;
+    set_status(LoaderStateReading, paths_l);
+}
+
+static void *load(void *arg)
+{
+    size_t paths_l;
+
+    if (get_lines(&lines, loader.stream, loader.separator, add_lines) != 0) {
+        set_status(LoaderStateError, 0);
+        return NULL;
+    }
+
+    /* The loader can only be cancelled while it waits for input */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    /* Sort and order paths for search in advance */
+    lock_paths();
+    sort_paths();
+    update_paths_order();
+    paths_l = get_paths_count();
+    unlock_paths();
+
+    set_status(LoaderStateDone, paths_l);
+
+    /* Paths can be browsed while the index is built */
+    if (loader.index_size > 0 && build_trigram_index(paths_l, loader.index_size, &loader.stop) == 0)
+        wake_up(0);
+
+    return NULL;
+}
+
+int start_loader(FILE *stream, char separator, PathState init_state, unsigned jobs,
+                 size_t index_size)
+{
+    int ret;
+    sigset_t set, oldset;
+
+    assert(!loader.started);
+
+    loader.stream = stream;
+    loader.separator = separator;
+    loader.status = (LoaderStatus){ .state = LoaderStateReading, .lines_l = 0, .paths_l = 0 };
+    loader.lines_l = 0;
+    loader.index_size = index_size;
+    loader.stop = 0;
+
+    init_paths(separator, init_state, jobs);
+
+    /* Signals must be handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    ret = pthread_create(&loader.thread, NULL, load, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (ret != 0) {
+        set_errorf("failed to start loader: %s", strerror(ret));
+        return 1;
+    }
+
+    loader.started = 1;
+    return 0;
+}
+
+LoaderStatus get_loader_status(void)
+{
+    LoaderStatus st;
+
+    pthread_mutex_lock(&loader.lock);
+    st = loader.status;
+    if (st.state == LoaderStateError)
+        set_error(loader.error);
+    pthread_mutex_unlock(&loader.lock);
+
+    return st;
+}
+
+/*
+ * Wait until the loader is done, but no longer than timeout_ms
+ */
+LoaderStatus wait_loader(int timeout_ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    while (loader.status.state != LoaderStateDone && loader.status.state != LoaderStateError) {
+        if (pthread_cond_timedwait(&loader.cond, &loader.lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&loader.lock);
+
+    return get_loader_status();
+}
+
+void stop_loader(void)
+{
+    if (!loader.started)
+        return;
+
+    __atomic_store_n(&loader.stop, 1, __ATOMIC_RELAXED);
+    pthread_cancel(loader.thread);
+    pthread_join(loader.thread, NULL);
+    loader.started = 0;
+
+    free_trigram_index();
+
+    /* Paths point to the lines and may still be read by the search */
+    free_paths();
+    free_lines(&lines);
+}
@@ -16,407 +16,2322 @@
  * ictree. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <regex.h>
+#include <signal.h>
+#include <stdlib.h>
 
+#include "arena.h"
 #include "error.h"
 #include "paths.h"
+#include "pattern.h"
+#include "trigrams.h"
 #include "utils.h"
 #include "vector.h"
 
-#define REGEX_ERR_HANDLER(ret)                                    \
-    do {                                                          \
-        char err_buf[64];                                         \
-        regerror(ret, &search_ctx.reg, err_buf, LENGTH(err_buf)); \
-        set_errorf("regex failed: %s", err_buf);                  \
+#define REGEX_ERR_HANDLER(ret)                                           \
+    do {                                                                 \
+        char err_buf[128];                                               \
+        get_regex_error(&search_ctx.reg, ret, err_buf, LENGTH(err_buf)); \
+        set_errorf("regex failed: %s", err_buf);                         \
     } while (0)
 
+#define MIN_PATH_INDEX_CAP 1024
+
+/* Paths are allocated in chunks, so they never move in memory. The table
+ * of chunks has a fixed size, so paths can be looked up without a lock. */
+#define PATH_CHUNK_BITS 16
+#define PATH_CHUNK_SIZE (1 << PATH_CHUNK_BITS)
+#define PATH_CHUNK_MASK (PATH_CHUNK_SIZE - 1)
+#define MAX_PATH_CHUNKS (1 << 16)
+
+#define MIN_SUBPATHS_CAP 2
+
+/* Directories with at least that many subpaths are sorted by all jobs
+ * together, smaller ones are distributed between jobs */
+#define PARALLEL_SORT_MIN 65536
+
+/* Number of directories a sort job takes at once */
+#define SORT_BATCH_SIZE 64
+
+#define MAX_JOBS 256
+
+/* Subpaths that consist of more sorted runs than that are sorted with qsort */
+#define MAX_MERGED_RUNS 32
+
+/* Paths are scanned in chunks, progress is tracked for every chunk */
+#define SCAN_CHUNK_BITS 14
+#define SCAN_CHUNK_SIZE (1 << SCAN_CHUNK_BITS)
+#define SCAN_CHUNK_MASK (SCAN_CHUNK_SIZE - 1)
+
+/* Number of paths matched before progress is reported or a stop request
+ * is checked */
+#define SCAN_BATCH_SIZE 1024
+
+/* Number of positions a search job takes at once. Searches that are not
+ * longer than that are done by the calling thread. */
+#define SEARCH_CHUNK_SIZE 16384
+
+/* Characters that have a special meaning in extended regular expressions */
+#define REGEX_META_CHARS "\\^$.[]|()*+?{}"
+
+/* Number of the best fuzzy matches that are kept */
+#define MAX_FOUND_PATHS 1024
+
+/* Number of paths a find job takes at once. It's a multiple of 64, so
+ * every word of the match bitset is written by one job. */
+#define FIND_CHUNK_SIZE 16384
+
+/* Scores of fuzzy matches. Every matched character scores, characters
+ * at the start of a component or a word score more. Gaps between matched
+ * characters are penalized. */
+#define SCORE_MATCH         16
+#define SCORE_GAP_START     -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_SEPARATOR     9
+#define BONUS_BOUNDARY      8
+#define BONUS_CONSECUTIVE   4
+#define BONUS_FIRST_CHAR    2 /* Multiplies the bonus of the first character */
+
+/* Characters that separate words in a component */
+#define WORD_DELIMS " -_."
+
 typedef struct SearchContext {
-    regex_t reg;
+    Regex reg;
     char *pattern;
     enum SearchDir dir;
     int full_path;
+    int literal;
+    int icase;
     int init;
+
+    /* Paths are matched against the pattern in the background. Bits of the
+     * first scanned[k] paths of chunk k are final, the rest of paths are
+     * matched on demand. */
+    uint64_t *matches;
+    size_t matches_l;
+    unsigned *scanned;
+    size_t scanned_l;
+    size_t scan_end;
+    size_t next_chunk;
+    pthread_t scanners[MAX_JOBS];
+    unsigned scanners_l;
+    unsigned scanning;
+    int scan_failed;
+    int stop;
+
+    /* Results of the search that this one refines. Paths that did not
+     * match it can't match this one either. */
+    uint64_t *filter;
+    unsigned *filter_scanned;
+    size_t filter_l;
+
+    /* Matches in tree order and the number of matches before every word
+     * of them. They are built once all paths are scanned. */
+    uint64_t *ranked;
+    size_t *ranks;
+    size_t matches_count;
 } SearchContext;
 
+/*
+ * Search for the nearest match in one direction. Positions are split in
+ * chunks that jobs take in the search direction.
+ */
+typedef struct SearchTask {
+    long start;
+    long count;
+    int dir;
+    size_t next;
+    long found; /* Distance to the nearest match, count if there is none */
+    int ret;
+    int stop;
+    unsigned running;
+} SearchTask;
+
+typedef struct FoundPath {
+    int score;
+    unsigned len;
+    PathLink link;
+} FoundPath;
+
+/*
+ * Fuzzy find: paths are scored in chunks that jobs take in turn. Paths
+ * that did not match the query it refines are skipped.
+ */
+typedef struct FindTask {
+    const char *query;
+    int icase;
+    size_t next;
+    size_t end;
+    uint64_t *candidates;
+    size_t candidates_end;
+    uint64_t *matched;
+    size_t matched_l;
+    int stop;
+    unsigned running;
+} FindTask;
+
+/* Every find job keeps the best matches it has seen in a heap with the
+ * worst of them on top */
+typedef struct FindJob {
+    FindTask *task;
+    FoundPath heap[MAX_FOUND_PATHS];
+    size_t heap_l;
+} FindJob;
+
+/*
+ * Hash table that maps a mainpath and a component name to a path
+ */
+typedef struct PathIndex {
+    size_t *slots; /* Path index + 1, 0 for an empty slot */
+    size_t cap;
+} PathIndex;
+
+/*
+ * Subpath with a prefix of its name packed into an integer, so most
+ * comparisons don't have to look at the name itself
+ */
+typedef struct SortItem {
+    uint64_t key;
+    PathLink link;
+} SortItem;
+
+/* Component of the last full path that was built and the length of the
+ * full path up to it */
+typedef struct PathWalkItem {
+    Path *path;
+    size_t len;
+} PathWalkItem;
+
+/*
+ * Buffer for full paths of paths that are visited one after another.
+ * Adjacent paths usually share mainpaths, so only components below the
+ * shared ones are rewritten.
+ */
+typedef struct PathWalk {
+    cvector_vector_type(char) buf;
+    cvector_vector_type(PathWalkItem) stack; /* Components by depth */
+} PathWalk;
+
+/* Directories that are shared between sort jobs */
+typedef struct SortQueue {
+    Path **dirs;
+    size_t dirs_l;
+    size_t next;
+} SortQueue;
+
+typedef struct SortTask {
+    PathLink *links;
+    SortItem *items;
+    SortItem *tmp;
+    size_t start;
+    size_t mid;
+    size_t end;
+} SortTask;
+
 static SearchContext search_ctx = { .init = 0 };
 
-static cvector_vector_type(Path) paths;
+static void start_scanner(SearchContext *ctx);
+
+/* All the memory of the tree belongs to the arena */
+static Arena arena;
+
+static Path *path_chunks[MAX_PATH_CHUNKS];
+static size_t paths_l = 0;
+
+/* Parent of all top-level paths. It's not stored with other paths. */
+static Path root = {
+    .line     = "",
+    .state    = PathStateUnfolded,
+    .mainpath = { -1 },
+    .sorted   = 1,
+};
+
+static PathIndex path_index = { .slots = NULL, .cap = 0 };
+
+/* Row that was looked up last time. The cursor row is looked up several
+ * times per event, while rows only move when something is folded,
+ * unfolded or added. */
+static size_t last_row;
+static Path *last_row_path = NULL;
+
+static cvector_vector_type(SortItem) sort_buf;
+static PathWalk full_path_walk = { .buf = NULL, .stack = NULL };
+static SortQueue sort_queue;
+
+/* Components of the last added line. Input is often sorted, so adjacent
+ * lines tend to share them and don't need to be looked up in the index. */
+static cvector_vector_type(PathLink) last_components;
+
+/* All paths in the order they appear in the tree */
+static cvector_vector_type(PathLink) ordered;
+static int order_stale = 1;
+
+static pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static char sep;
+static PathState init_state;
+
+/* Number of threads that sort and search paths */
+static unsigned jobs_l = 1;
+
+/* The best matches of the last fuzzy query, best first, and the number
+ * of all its matches */
+static cvector_vector_type(FoundPath) found;
+static size_t found_matches_l = 0;
+
+/* Paths that matched the last fuzzy query, which was matched against
+ * the first find_matches_end paths */
+static char *find_query = NULL;
+static uint64_t *find_matches = NULL;
+static size_t find_matches_end = 0;
+
+/* Whether only matches of the search and their mainpaths are shown */
+static int filtered = 0;
+
+/* Directories that were unfolded to show matches. They are folded back
+ * when all paths are shown again. */
+static cvector_vector_type(Path *) filter_unfolded;
+
+void lock_paths(void)
+{
+    pthread_mutex_lock(&paths_lock);
+}
+
+void unlock_paths(void)
+{
+    pthread_mutex_unlock(&paths_lock);
+}
 
 /*
  * Find length of the first component path component
  */
 static unsigned long get_first_component_length(char *path)
 {
-    char c;
-    unsigned long len = strlen(path);
+    char *c;
 
-    for (unsigned long i = 0; i < len; i++) {
-        c = path[i];
-        if (c == sep) {
-            return i;
-        }
-    }
+    for (c = path; *c != '\0' && *c != sep; c++)
+        ;
 
-    return len;
+    return c - path;
 }
 
 Path *get_path_from_link(PathLink link)
 {
-    return paths + link.index;
+    return path_chunks[link.index >> PATH_CHUNK_BITS] + (link.index & PATH_CHUNK_MASK);
+}
+
+static Path *get_mainpath(Path *path)
+{
+    return HAS_MAIN_PATH(*path) ? get_path_from_link(path->mainpath) : &root;
+}
+
+/*
+ * Components are compared as if they ended with a separator. That way the
+ * order is the same as if full paths were sorted. Leading blanks of
+ * top-level paths are ignored.
+ */
+static int subpath_compare(const void *a, const void *b)
+{
+    Path *p1 = get_path_from_link(*(PathLink *)a), *p2 = get_path_from_link(*(PathLink *)b);
+    const char *s1 = p1->line, *s2 = p2->line;
+    int c1, c2;
+
+    if (p1->depth == 0) {
+        s1 += find_first_nonblank((char *)s1);
+        s2 += find_first_nonblank((char *)s2);
+    }
+
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+
+    c1 = *s1 != '\0' ? (unsigned char)*s1 : (unsigned char)sep;
+    c2 = *s2 != '\0' ? (unsigned char)*s2 : (unsigned char)sep;
+
+    return c1 - c2;
 }
 
 /*
- * Warning: you should check if a path is already unfolded or not: unfolding an
- * unfolded path causes it to appear multiple times in the tree
+ * Pack the first bytes of a name followed by the separator into an integer.
+ * Names never contain the separator, so keys compare the same way as names
+ * unless they are equal.
  */
-size_t unfold_path(UnfoldedPaths *unfolded_paths, size_t i)
+static uint64_t get_sort_key(Path *p)
 {
-    assert(i < unfolded_paths->len);
+    const char *s = p->line;
+    uint64_t key = 0;
+    int i;
+
+    if (p->depth == 0)
+        s += find_first_nonblank((char *)s);
 
-    Path *p = get_path_from_link(unfolded_paths->links[i]);
+    for (i = 0; i < 8 && s[i] != '\0'; i++)
+        key |= (uint64_t)(unsigned char)s[i] << (56 - i * 8);
 
-    size_t first_subpath_i, j, off = 0, subpaths_l = cvector_size(p->subpaths);
+    if (i < 8)
+        key |= (uint64_t)(unsigned char)sep << (56 - i * 8);
 
-    if (subpaths_l == 0)
-        goto end;
+    return key;
+}
 
-    first_subpath_i = i + 1;
+static int sort_item_compare(const void *a, const void *b)
+{
+    const SortItem *i1 = a, *i2 = b;
 
-    /* Move paths down in the array to make room for subpaths of *p */
-    memmove(unfolded_paths->links + first_subpath_i + subpaths_l,
-            unfolded_paths->links + first_subpath_i,
-            (unfolded_paths->len - first_subpath_i) * sizeof(PathLink));
+    if (i1->key != i2->key)
+        return i1->key < i2->key ? -1 : 1;
 
-    unfolded_paths->len += subpaths_l;
-    assert(unfolded_paths->len <= cvector_size(paths));
+    return subpath_compare(&i1->link, &i2->link);
+}
 
-    /* Add subpaths */
-    for (j = 0; j < subpaths_l; j++) {
-        unfolded_paths->links[first_subpath_i + j] = p->subpaths[j];
+static void fill_sort_items(SortItem *items, PathLink *links, size_t links_l)
+{
+    for (size_t i = 0; i < links_l; i++) {
+        items[i].key = get_sort_key(get_path_from_link(links[i]));
+        items[i].link = links[i];
     }
+}
 
-    /* Unfold subpaths. This part (or the whole thing) needs to optimized
-     * because unfolding a path with many subpaths may be quite slow
-     * compared to folding. */
-    for (j = 0; j < subpaths_l; j++) {
-        if (get_path_from_link(p->subpaths[j])->state == PathStateUnfolded) {
-            off += unfold_path(unfolded_paths, first_subpath_i + j + off);
-        }
+/*
+ * Start up to n threads that run fn(arg). Returns the number of threads
+ * that were started.
+ */
+static unsigned start_threads(pthread_t *threads, unsigned n, void *(*fn)(void *), void *arg)
+{
+    sigset_t set, oldset;
+    unsigned i;
+
+    /* Signals must be handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, fn, arg) != 0)
+            break;
     }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 
-end:
+    return i;
+}
 
-    p->state = PathStateUnfolded;
-    return off + subpaths_l;
+static void join_threads(pthread_t *threads, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
 }
 
-size_t fold_path(UnfoldedPaths *unfolded_paths, size_t i)
+/*
+ * Run fn for every argument, each one in a separate thread. The current
+ * thread takes the first argument and the ones of threads that can't be
+ * started.
+ */
+static void run_jobs(void *(*fn)(void *), void *args, size_t arg_size, unsigned jobs)
 {
-    assert(i < unfolded_paths->len);
+    pthread_t threads[jobs];
+    unsigned started, i;
+
+    for (started = 1; started < jobs; started++) {
+        if (start_threads(&threads[started], 1, fn, (char *)args + started * arg_size) == 0)
+            break;
+    }
 
-    size_t k, diff = 0;
+    fn(args);
+    for (i = started; i < jobs; i++)
+        fn((char *)args + i * arg_size);
 
-    Path *p = get_path_from_link(unfolded_paths->links[i]);
+    join_threads(&threads[1], started - 1);
+}
+
+/*
+ * Merge sorted [start, mid) and [mid, end) of items into tmp
+ */
+static void *merge_parts_job(void *arg)
+{
+    SortTask *t = arg;
+    size_t i = t->start, j = t->mid, k = t->start;
+
+    while (i < t->mid && j < t->end) {
+        if (sort_item_compare(&t->items[j], &t->items[i]) < 0)
+            t->tmp[k++] = t->items[j++];
+        else
+            t->tmp[k++] = t->items[i++];
+    }
 
-    if (cvector_size(p->subpaths) == 0)
-        goto end;
+    memcpy(t->tmp + k, t->items + i, (t->mid - i) * sizeof(SortItem));
+    k += t->mid - i;
+    memcpy(t->tmp + k, t->items + j, (t->end - j) * sizeof(SortItem));
 
-    unsigned depth = p->depth;
+    return NULL;
+}
 
-    /* Find the first path that is not a subpath of *p */
-    for (k = i + 1; k < unfolded_paths->len; k++) {
-        Path *p2 = get_path_from_link(unfolded_paths->links[k]);
-        if (p2->depth <= depth) {
-            break;
+/*
+ * Merge sorted parts of items pairwise until only one is left. Parts are
+ * separated by bounds. Returns either items or tmp, whichever holds the
+ * result.
+ */
+static SortItem *merge_parts(SortItem *items, SortItem *tmp, size_t *bounds, unsigned parts_l,
+                             unsigned jobs)
+{
+    SortTask tasks[parts_l];
+    SortItem *swap;
+    unsigned i, tasks_l, width;
+
+    for (width = 1; width < parts_l; width *= 2) {
+        tasks_l = 0;
+        for (i = 0; i < parts_l; i += width * 2) {
+            tasks[tasks_l++] = (SortTask){
+                .items = items,
+                .tmp   = tmp,
+                .start = bounds[i],
+                .mid   = bounds[MIN(i + width, parts_l)],
+                .end   = bounds[MIN(i + width * 2, parts_l)],
+            };
         }
-    }
 
-    /* Move all the paths after *p (that are not its subpaths) to a
-     * position right after *p, thus erasing the subpaths */
-    memmove(unfolded_paths->links + i + 1, unfolded_paths->links + k,
-            (unfolded_paths->len - k) * sizeof(PathLink));
-    diff = k - i - 1;
-    unfolded_paths->len -= diff;
+        if (jobs > 1) {
+            run_jobs(merge_parts_job, tasks, sizeof(SortTask), tasks_l);
+        } else {
+            for (i = 0; i < tasks_l; i++)
+                merge_parts_job(&tasks[i]);
+        }
 
-end:
+        swap = items;
+        items = tmp;
+        tmp = swap;
+    }
 
-    p->state = PathStateFolded;
-    return diff;
+    return items;
 }
 
-void unfold_nested_path(UnfoldedPaths *unfolded_paths, Path *path, size_t *pos)
+/*
+ * Links that are almost sorted consist of a few sorted runs. Merging them
+ * is cheaper than sorting everything from scratch.
+ */
+static void sort_links(PathLink *links, size_t links_l, SortItem **buf)
 {
-    Path *p = path;
-    cvector_vector_type(Path *) queue = NULL;
+    size_t bounds[MAX_MERGED_RUNS + 1], runs_l = 0, i;
+    SortItem *items, *tmp;
 
-    while (1) {
-        cvector_push_back(queue, p);
+    if (links_l < 2)
+        return;
 
-        if (!HAS_MAIN_PATH(*p))
-            break;
+    if (cvector_capacity(*buf) < links_l * 2)
+        cvector_grow(*buf, links_l * 2);
 
-        p = get_path_from_link(p->mainpath);
+    items = *buf;
+    tmp = *buf + links_l;
+
+    fill_sort_items(items, links, links_l);
+
+    bounds[runs_l++] = 0;
+    for (i = 1; i < links_l && runs_l <= MAX_MERGED_RUNS; i++) {
+        if (sort_item_compare(&items[i - 1], &items[i]) > 0)
+            bounds[runs_l++] = i;
     }
 
-    size_t u_i = 0;
-    long i = cvector_size(queue) - 1;
-    while (1) {
-        p = get_path_from_link(unfolded_paths->links[u_i]);
-        if (p == queue[i]) {
-            if (p->state == PathStateFolded)
-                unfold_path(unfolded_paths, u_i);
-            if (p == path) {
-                if (pos != NULL)
-                    *pos = u_i;
-                break;
-            }
-            i--;
-            assert(i >= 0);
-        }
-        u_i++;
-        assert(u_i < unfolded_paths->len);
+    if (runs_l == 1)
+        return;
+
+    if (runs_l <= MAX_MERGED_RUNS) {
+        bounds[runs_l] = links_l;
+        items = merge_parts(items, tmp, bounds, runs_l, 1);
+    } else {
+        qsort(items, links_l, sizeof(SortItem), sort_item_compare);
     }
 
-    cvector_free(queue);
+    for (i = 0; i < links_l; i++)
+        links[i] = items[i].link;
 }
 
-static char *get_full_path(PathLink *links, size_t links_l, char *line)
+/*
+ * Subpaths are kept in the order they were added until they are needed
+ */
+static void sort_subpaths(Path *p)
 {
-    unsigned long i;
-    unsigned long str_l;
+    if (p->sorted)
+        return;
+
+    sort_links(p->subpaths, p->subpaths_l, &sort_buf);
+    p->sorted = 1;
+}
 
-    str_l = 0;
-    for (i = 0; i < links_l; i++) {
-        str_l += strlen(get_path_from_link(links[i])->line);
-        str_l += 1; /* For dir delimeter */
+static void *sort_dirs_job(void *arg)
+{
+    cvector_vector_type(SortItem) buf = NULL;
+    size_t i, end;
+    Path *p;
+
+    (void)arg;
+
+    while ((i = __atomic_fetch_add(&sort_queue.next, SORT_BATCH_SIZE, __ATOMIC_RELAXED))
+            < sort_queue.dirs_l) {
+        end = MIN(i + SORT_BATCH_SIZE, sort_queue.dirs_l);
+        for (; i < end; i++) {
+            p = sort_queue.dirs[i];
+            sort_links(p->subpaths, p->subpaths_l, &buf);
+            p->sorted = 1;
+        }
     }
 
-    if (strlen(line) == 0)
-        line = "/";
+    cvector_free(buf);
+    return NULL;
+}
+
+static void *sort_part_job(void *arg)
+{
+    SortTask *t = arg;
+
+    fill_sort_items(t->items + t->start, t->links + t->start, t->end - t->start);
+    qsort(t->items + t->start, t->end - t->start, sizeof(SortItem), sort_item_compare);
+
+    return NULL;
+}
 
-    str_l += strlen(line);
+/*
+ * Sort parts of a big directory in parallel and merge them
+ */
+static void sort_subpaths_parallel(Path *p, unsigned jobs)
+{
+    size_t n = p->subpaths_l, bounds[jobs + 1];
+    SortItem *items = malloc(n * sizeof(SortItem)), *tmp = malloc(n * sizeof(SortItem)), *res;
+    SortTask tasks[jobs];
+    unsigned i;
 
-    char *str = calloc(str_l + 1, sizeof(char));
+    for (i = 0; i <= jobs; i++)
+        bounds[i] = n * i / jobs;
 
-    for (i = 0; i < links_l; i++) {
-        strncat(str, get_path_from_link(links[i])->line, str_l);
-        strncat(str, "/", str_l);
+    for (i = 0; i < jobs; i++) {
+        tasks[i] = (SortTask){ .links = p->subpaths, .items = items,
+                               .start = bounds[i], .end = bounds[i + 1] };
     }
+    run_jobs(sort_part_job, tasks, sizeof(SortTask), jobs);
+
+    res = merge_parts(items, tmp, bounds, jobs, jobs);
 
-    strncat(str, line, str_l);
+    for (size_t j = 0; j < n; j++)
+        p->subpaths[j] = res[j].link;
 
-    return str;
+    p->sorted = 1;
+
+    free(items);
+    free(tmp);
 }
 
-static void free_full_path(char *str)
+static void queue_unsorted_dir(Path *p, unsigned jobs)
 {
-    free(str);
+    if (p->sorted)
+        return;
+
+    if (p->subpaths_l < 2) {
+        p->sorted = 1;
+    } else if (jobs > 1 && p->subpaths_l >= PARALLEL_SORT_MIN) {
+        sort_subpaths_parallel(p, jobs);
+    } else {
+        sort_queue.dirs[sort_queue.dirs_l++] = p;
+    }
 }
 
-static int init_search_ctx(SearchContext *ctx, char *pattern, enum SearchDir dir)
+/*
+ * Sort subpaths of every directory
+ */
+void sort_paths(void)
 {
-    int ret;
+    unsigned jobs = jobs_l;
+    size_t i;
 
-    assert(!ctx->init);
+    sort_queue.dirs = malloc((paths_l + 1) * sizeof(Path *));
+    sort_queue.dirs_l = 0;
+    sort_queue.next = 0;
 
-    ctx->pattern = strdup(pattern);
+    queue_unsorted_dir(&root, jobs);
+    for (i = 0; i < paths_l; i++)
+        queue_unsorted_dir(get_path_from_link((PathLink){ i }), jobs);
 
-    if ((ret = regcomp(&ctx->reg, ctx->pattern, REG_EXTENDED)) != 0)
-        return ret;
+    jobs = MIN(jobs, sort_queue.dirs_l / SORT_BATCH_SIZE + 1);
+    run_jobs(sort_dirs_job, NULL, 0, jobs);
 
-    /* Perform search by full path if pattern contains DIR_DELIM */
-    ctx->full_path = strchr(ctx->pattern, sep) != NULL;
+    free(sort_queue.dirs);
+    sort_queue.dirs = NULL;
+}
 
-    ctx->dir = dir;
-    ctx->init = 1;
+/*
+ * Rows of a directory are counted with a Fenwick tree over its subpaths.
+ * Every subpath takes one row plus rows of its own subpaths if it's
+ * unfolded.
+ */
+static size_t get_path_weight(Path *p)
+{
+    if (p->hidden)
+        return 0;
 
-    return 0;
+    return 1 + (p->state == PathStateUnfolded ? p->rows : 0);
 }
 
-static void deinit_search_ctx(SearchContext *ctx)
+static void rows_index_add(Path *p, size_t i, size_t delta)
 {
-    assert(ctx->init);
+    for (i++; i <= p->subpaths_l; i += i & -i)
+        p->rows_index[i - 1] += delta;
+}
 
-    regfree(&ctx->reg);
-    free(ctx->pattern);
-    ctx->init = 0;
+/*
+ * Number of rows taken by the first n subpaths of p
+ */
+static size_t rows_index_sum(Path *p, size_t n)
+{
+    size_t sum = 0;
+
+    for (; n > 0; n -= n & -n)
+        sum += p->rows_index[n - 1];
+
+    return sum;
 }
 
-size_t get_paths(UnfoldedPaths *unfolded_paths, char **lines, size_t lines_l, char separator, PathState init_state)
+/*
+ * Find the subpath of p that takes the given row. Row is replaced with its
+ * offset inside of the subpath.
+ */
+static size_t rows_index_find(Path *p, size_t *row)
 {
-    Path p;
-    PathLink pl;
-    char *line;
-    size_t i;
-    unsigned long comp_len, line_off, depth;
+    size_t i = 0, step;
 
-    sep = separator;
+    for (step = 1; step * 2 <= p->subpaths_l; step *= 2)
+        ;
 
-    paths = NULL;
-    unfolded_paths->links = NULL;
+    for (; step > 0; step /= 2) {
+        if (i + step <= p->subpaths_l && p->rows_index[i + step - 1] <= *row) {
+            i += step;
+            *row -= p->rows_index[i - 1];
+        }
+    }
 
-    /* Set initial capacity for vectors */
-    cvector_grow(paths, lines_l);
-    cvector_grow(unfolded_paths->links, lines_l);
+    return i;
+}
 
-    cvector_vector_type(PathLink) stack = NULL;
+/*
+ * Subpaths are indexed when rows of a directory are needed for the first
+ * time after subpaths were added
+ */
+static void index_rows(Path *p)
+{
+    size_t i, j;
+    Path *subpath;
 
-    i = 0, line_off = 0;
-    while (i < lines_l) {
-        if (line_off == 0)
-            depth = 0;
+    if (p->indexed)
+        return;
 
-        line = lines[i] + line_off;
-        comp_len = get_first_component_length(line);
+    sort_subpaths(p);
 
-        line_off += comp_len + 1;
+    if (p->rows_index == NULL) {
+        p->rows_index = alloc_arena(&arena, p->subpaths_cap * sizeof(size_t));
+    }
 
-        if (comp_len == 0 && depth > 0) {
-            i++;
-            line_off = 0;
-            continue;
-        }
+    for (i = 0; i < p->subpaths_l; i++) {
+        subpath = get_path_from_link(p->subpaths[i]);
+        subpath->pos = i;
+        p->rows_index[i] = get_path_weight(subpath);
+    }
 
-        /* If it's the last component of path, start processing next line.
-         * Otherwise replace DIR_DELIM with 0 to make a new string */
-        if (line[comp_len] == '\0') {
-            i++;
-            line_off = 0;
-        } else {
-            line[comp_len] = '\0';
-        }
+    for (i = 1; i <= p->subpaths_l; i++) {
+        j = i + (i & -i);
+        if (j <= p->subpaths_l)
+            p->rows_index[j - 1] += p->rows_index[i - 1];
+    }
 
-        p.line       = line;
-        p.subpaths   = NULL;
-        p.subpaths_l = 0;
-        p.mainpath   = NO_LINK;
-        p.state      = PathStateFolded;
-        p.depth      = depth;
+    p->indexed = 1;
+}
 
-        pl = (PathLink){ cvector_size(paths) };
+/*
+ * Weight of p has changed by delta: update rows of its mainpaths up to the
+ * first folded one. Negative deltas wrap around, which is fine for unsigned
+ * arithmetic.
+ */
+static void propagate_rows(Path *p, size_t delta)
+{
+    Path *mainpath;
 
-        if (depth < cvector_size(stack)) {
-            if (strcmp(p.line, get_path_from_link(stack[depth])->line) == 0) {
-                depth++;
-                continue;
-            }
-            cvector_set_size(stack, depth);
-        }
+    last_row_path = NULL;
 
-        if (cvector_size(stack) > 0) {
-            PathLink mainpath_l = stack[cvector_size(stack) - 1];
-            Path *mainpath = get_path_from_link(mainpath_l);
-            cvector_push_back(mainpath->subpaths, pl);
-            mainpath->subpaths_l++;
-            mainpath->state = init_state;
-            p.mainpath = mainpath_l;
-            if (mainpath->state == PathStateUnfolded) {
-                cvector_push_back(unfolded_paths->links, pl);
-            }
-        } else {
-            cvector_push_back(unfolded_paths->links, pl);
-        }
+    while (p != &root) {
+        mainpath = get_mainpath(p);
+        if (mainpath->indexed)
+            rows_index_add(mainpath, p->pos, delta);
+        mainpath->rows += delta;
 
-        p.full_path = get_full_path(stack, cvector_size(stack), p.line);
+        if (mainpath->state == PathStateFolded)
+            break;
 
-        cvector_push_back(stack, pl);
-        cvector_push_back(paths, p);
-        depth++;
+        p = mainpath;
     }
+}
+
+void unfold_path(Path *p)
+{
+    if (p->state == PathStateUnfolded)
+        return;
 
-    if (stack != NULL)
-        cvector_free(stack);
-    unfolded_paths->len = cvector_size(unfolded_paths->links);
-    return cvector_size(paths);
+    p->state = PathStateUnfolded;
+    if (!p->hidden)
+        propagate_rows(p, p->rows);
 }
 
-void free_paths(UnfoldedPaths unfolded_paths)
+void fold_path(Path *p)
 {
-    if (paths != NULL) {
-        for (size_t i = 0; i < cvector_size(paths); i++) {
-            cvector_free(paths[i].subpaths);
-            free_full_path(paths[i].full_path);
-        }
-        cvector_free(paths);
-        paths = NULL;
-    }
+    if (p->state == PathStateFolded)
+        return;
 
-    if (unfolded_paths.links != NULL) {
-        cvector_free(unfolded_paths.links);
-        unfolded_paths.links = NULL;
-    }
+    p->state = PathStateFolded;
+    if (!p->hidden)
+        propagate_rows(p, -p->rows);
+}
 
-    if (search_ctx.init) {
-        deinit_search_ctx(&search_ctx);
-    }
+/*
+ * Unfold a path and all of its mainpaths, so that it becomes visible, and
+ * return its row. Mainpaths are unfolded from the bottom: rows of every
+ * path only need to be updated up to the next folded mainpath.
+ */
+size_t unfold_nested_path(Path *path)
+{
+    for (Path *p = path; p != &root; p = get_mainpath(p))
+        unfold_path(p);
+
+    return get_path_row(path);
 }
 
-int init_paths_search(char *pattern, enum SearchDir dir)
+size_t get_rows_count(void)
 {
-    int ret;
+    return root.rows;
+}
 
-    if (search_ctx.init) {
-        deinit_search_ctx(&search_ctx);
+Path *get_row_path(size_t row)
+{
+    Path *p = &root, *subpath;
+    size_t i = row;
+
+    assert(row < root.rows);
+
+    if (last_row_path != NULL && last_row == row)
+        return last_row_path;
+
+    while (1) {
+        index_rows(p);
+        subpath = get_path_from_link(p->subpaths[rows_index_find(p, &i)]);
+        if (i == 0)
+            break;
+        i--;
+        p = subpath;
     }
 
-    if ((ret = init_search_ctx(&search_ctx, pattern, dir)) != 0) {
-        REGEX_ERR_HANDLER(ret);
-        return 1;
+    last_row = row;
+    last_row_path = subpath;
+    return subpath;
+}
+
+/*
+ * The path must be visible
+ */
+size_t get_path_row(Path *path)
+{
+    Path *p, *mainpath;
+    size_t row = 0;
+
+    for (p = path; p != &root; p = mainpath) {
+        mainpath = get_mainpath(p);
+        index_rows(mainpath);
+        row += rows_index_sum(mainpath, p->pos);
+        if (mainpath != &root)
+            row++;
     }
 
-    return 0;
+    return row;
 }
 
-enum MatchStatus path_match_pattern(Path *path)
+/*
+ * Find the row of the mainpath of a visible path that is on the given row
+ */
+size_t get_mainpath_row(Path *path, size_t row)
 {
-    int ret;
-    char *s;
+    Path *mainpath = get_mainpath(path);
 
-    if (!search_ctx.init)
-        return MatchStatusFail;
+    assert(mainpath != &root);
 
-    s = search_ctx.full_path ? path->full_path : path->line;
-    ret = regexec(&search_ctx.reg, s, 0, NULL, 0);
+    index_rows(mainpath);
+    return row - 1 - rows_index_sum(mainpath, path->pos);
+}
 
-    if (ret == 0)
-        return MatchStatusOk;
+/*
+ * Get the subpath of p that starts on the given row of its subpaths
+ */
+static Path *get_subpath_on_row(Path *p, size_t row)
+{
+    index_rows(p);
+    return get_path_from_link(p->subpaths[rows_index_find(p, &row)]);
+}
 
-    if (ret == REG_NOMATCH) {
-        return MatchStatusFail;
+/*
+ * Get the path on the next row or NULL if p is on the last one. Hidden
+ * subpaths take no rows, so they are skipped.
+ */
+Path *get_next_row_path(Path *p)
+{
+    Path *mainpath;
+    size_t row;
+
+    if (p->state == PathStateUnfolded && p->rows > 0)
+        return get_subpath_on_row(p, 0);
+
+    for (; p != &root; p = mainpath) {
+        mainpath = get_mainpath(p);
+        index_rows(mainpath);
+        row = rows_index_sum(mainpath, p->pos + 1);
+        if (row < mainpath->rows)
+            return get_subpath_on_row(mainpath, row);
     }
 
-    REGEX_ERR_HANDLER(ret);
-    return MatchStatusErr;
+    return NULL;
 }
 
-int search_path(PathLink *match, PathLink start, int invert_dir)
+static void number_subpaths(Path *p)
 {
-    if (!search_ctx.init) {
-        set_error("Search query was not given");
-        return 1;
-    }
+    Path *subpath;
 
-    int dir = search_ctx.dir;
-    if (invert_dir)
-        dir *= -1;
+    sort_subpaths(p);
 
-    long i = start.index + dir;
-    while (i < (long)cvector_size(paths) && i >= 0) {
-        enum MatchStatus st = path_match_pattern(paths + i);
-        if (st == 0) {
-            *match = (PathLink){ .index = i };
-            return 0;
-        } else if (st == MatchStatusErr) {
-            return 1;
-        }
-        i += dir;
+    for (size_t i = 0; i < p->subpaths_l; i++) {
+        subpath = get_path_from_link(p->subpaths[i]);
+        subpath->order = cvector_size(ordered);
+        cvector_push_back(ordered, p->subpaths[i]);
+        number_subpaths(subpath);
     }
+}
+
+/*
+ * Sort all the paths in the order they appear in the fully unfolded tree
+ */
+void update_paths_order(void)
+{
+    if (!order_stale)
+        return;
+
+    if (cvector_capacity(ordered) < paths_l)
+        cvector_grow(ordered, paths_l);
+
+    cvector_set_size(ordered, 0);
+    number_subpaths(&root);
+    order_stale = 0;
+}
+
+/*
+ * Full paths are not stored: they are built in the buffer of the walk.
+ * Components that the path shares with the last one stay in the buffer,
+ * the rest are found by walking up the tree.
+ */
+static char *walk_full_path(PathWalk *w, Path *path)
+{
+    Path *p;
+    size_t depth = path->depth, keep, len, line_l, cap;
+
+    for (p = path; p != &root; p = get_mainpath(p)) {
+        if (p->depth < cvector_size(w->stack) && w->stack[p->depth].path == p)
+            break;
+    }
+
+    keep = p == &root ? 0 : p->depth + 1;
+    len = keep > 0 ? w->stack[keep - 1].len : 0;
+
+    if (cvector_capacity(w->stack) < depth + 1)
+        cvector_grow(w->stack, depth + 1);
+    cvector_set_size(w->stack, depth + 1);
+
+    for (p = path; p->depth >= keep && p != &root; p = get_mainpath(p))
+        w->stack[p->depth].path = p;
+
+    /* Components are joined with '/'. Full path of the root directory
+     * already ends with it. */
+    for (size_t d = keep; d <= depth; d++) {
+        p = w->stack[d].path;
+        line_l = strlen(p->line);
+
+        if ((cap = cvector_capacity(w->buf)) < len + line_l + 2)
+            cvector_grow(w->buf, MAX(len + line_l + 2, cap * 2));
+
+        if (d > 0 && w->stack[d - 1].path->line[0] != '\0')
+            w->buf[len++] = '/';
+
+        if (line_l > 0) {
+            memcpy(w->buf + len, p->line, line_l);
+            len += line_l;
+        } else {
+            w->buf[len++] = '/';
+        }
+
+        w->stack[d].len = len;
+    }
+
+    w->buf[len] = '\0';
+    return w->buf;
+}
+
+static void free_path_walk(PathWalk *w)
+{
+    if (w->buf != NULL)
+        cvector_free(w->buf);
+    if (w->stack != NULL)
+        cvector_free(w->stack);
+    w->buf = NULL;
+    w->stack = NULL;
+}
+
+/*
+ * The string is only valid until the next call
+ */
+char *get_full_path(Path *path)
+{
+    return walk_full_path(&full_path_walk, path);
+}
+
+/*
+ * Find the link of a visible path
+ */
+static PathLink get_path_link(Path *path)
+{
+    Path *mainpath = get_mainpath(path);
+
+    index_rows(mainpath);
+    return mainpath->subpaths[path->pos];
+}
+
+static size_t hash_subpath(size_t mainpath_i, const char *line, size_t len)
+{
+    /* FNV-1a */
+    size_t h = 14695981039346656037ULL ^ mainpath_i;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)line[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static void index_insert(size_t *slots, size_t cap, size_t h, size_t i)
+{
+    size_t mask = cap - 1;
+
+    for (h &= mask; slots[h] != 0; h = (h + 1) & mask)
+        ;
+
+    slots[h] = i + 1;
+}
+
+static void index_grow(PathIndex *index)
+{
+    Path *p;
+    size_t cap = MAX(MIN_PATH_INDEX_CAP, index->cap * 2);
+    size_t *slots = calloc(cap, sizeof(slots[0]));
+
+    for (size_t i = 0; i < index->cap; i++) {
+        if (index->slots[i] == 0)
+            continue;
+        p = get_path_from_link((PathLink){ index->slots[i] - 1 });
+        index_insert(slots, cap, hash_subpath(p->mainpath.index, p->line, strlen(p->line)),
+                     index->slots[i] - 1);
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->cap = cap;
+}
+
+/*
+ * Find a subpath of mainpath with the given name
+ */
+static PathLink find_subpath(size_t mainpath_i, const char *line, size_t len, size_t h)
+{
+    Path *p;
+    size_t mask = path_index.cap - 1;
+
+    if (path_index.cap == 0)
+        return NO_LINK;
+
+    for (h &= mask; path_index.slots[h] != 0; h = (h + 1) & mask) {
+        p = get_path_from_link((PathLink){ path_index.slots[h] - 1 });
+        if (p->mainpath.index == mainpath_i && strncmp(p->line, line, len) == 0
+                && p->line[len] == '\0') {
+            return (PathLink){ path_index.slots[h] - 1 };
+        }
+    }
+
+    return NO_LINK;
+}
+
+/*
+ * Arrays of subpaths are doubled when they are full. Old arrays are
+ * recycled for directories with fewer subpaths.
+ */
+static void append_subpath(Path *p, PathLink pl)
+{
+    PathLink *subpaths;
+    size_t cap;
+
+    if (p->subpaths_l == p->subpaths_cap) {
+        cap = MAX(MIN_SUBPATHS_CAP, p->subpaths_cap * 2);
+        subpaths = alloc_arena(&arena, cap * sizeof(PathLink));
+        if (p->subpaths_l > 0)
+            memcpy(subpaths, p->subpaths, p->subpaths_l * sizeof(PathLink));
+        recycle_arena(&arena, p->subpaths, p->subpaths_cap * sizeof(PathLink));
+        recycle_arena(&arena, p->rows_index, p->subpaths_cap * sizeof(size_t));
+        p->subpaths = subpaths;
+        p->subpaths_cap = cap;
+        p->rows_index = NULL;
+    }
+
+    p->subpaths[p->subpaths_l++] = pl;
+    p->indexed = 0;
+}
+
+static PathLink new_path(size_t mainpath_i, char *line, unsigned depth, size_t h)
+{
+    Path *p, *mainpath;
+    PathLink pl = { paths_l };
+
+    if ((paths_l & PATH_CHUNK_MASK) == 0) {
+        assert((paths_l >> PATH_CHUNK_BITS) < MAX_PATH_CHUNKS);
+        path_chunks[paths_l >> PATH_CHUNK_BITS] = alloc_arena(&arena, PATH_CHUNK_SIZE * sizeof(Path));
+    }
+
+    paths_l++;
+    p = get_path_from_link(pl);
+
+    p->line         = line;
+    p->subpaths     = NULL;
+    p->subpaths_l   = 0;
+    p->subpaths_cap = 0;
+    p->mainpath     = (PathLink){ mainpath_i };
+    p->state        = PathStateFolded;
+    p->depth        = depth;
+    p->sorted       = 1;
+    p->order        = 0;
+    p->rows         = 0;
+    p->rows_index   = NULL;
+    p->indexed      = 0;
+    p->pos          = 0;
+    p->hidden       = filtered;
+
+    mainpath = get_mainpath(p);
+
+    /* Sorted input keeps subpaths sorted */
+    if (mainpath->sorted && mainpath->subpaths_l > 0
+            && subpath_compare(&mainpath->subpaths[mainpath->subpaths_l - 1], &pl) > 0)
+        mainpath->sorted = 0;
+
+    append_subpath(mainpath, pl);
+    if (mainpath != &root && mainpath->subpaths_l == 1)
+        mainpath->state = init_state;
+
+    /* Paths that are added while the tree is filtered are not shown */
+    if (!p->hidden)
+        propagate_rows(p, 1);
+
+    if ((paths_l + 1) * 2 > path_index.cap)
+        index_grow(&path_index);
+    index_insert(path_index.slots, path_index.cap, h, pl.index);
+
+    order_stale = 1;
+    return pl;
+}
+
+/*
+ * Add every component of a line to the tree unless it's already there.
+ * Separators in the line are replaced with '\0'.
+ */
+static void add_path(char *line)
+{
+    char *comp = line;
+    size_t mainpath_i = NO_LINK.index, h;
+    unsigned depth = 0;
+    unsigned long comp_len;
+    int last, new = 0;
+    PathLink pl;
+
+    while (1) {
+        comp_len = get_first_component_length(comp);
+        last = comp[comp_len] == '\0';
+
+        /* Skip empty components unless it's the root directory */
+        if (comp_len > 0 || depth == 0) {
+            comp[comp_len] = '\0';
+
+            if (depth < cvector_size(last_components)
+                    && strcmp(get_path_from_link(last_components[depth])->line, comp) == 0) {
+                pl = last_components[depth];
+            } else {
+                /* A path that was just created has no subpaths to look for */
+                h = hash_subpath(mainpath_i, comp, comp_len);
+                pl = new ? NO_LINK : find_subpath(mainpath_i, comp, comp_len, h);
+                if (IS_NO_LINK(pl)) {
+                    pl = new_path(mainpath_i, comp, depth, h);
+                    new = 1;
+                }
+
+                cvector_set_size(last_components, MIN(depth, cvector_size(last_components)));
+                cvector_push_back(last_components, pl);
+            }
+
+            mainpath_i = pl.index;
+            depth++;
+        }
+
+        if (last)
+            break;
+
+        comp += comp_len + 1;
+    }
+}
+
+void init_paths(char separator, PathState init_paths_state, unsigned jobs)
+{
+    sep = separator;
+    init_state = init_paths_state;
+    jobs_l = MIN(MAX(jobs, 1), MAX_JOBS);
+}
+
+size_t add_paths(char **lines, size_t lines_l)
+{
+    for (size_t i = 0; i < lines_l; i++) {
+        add_path(lines[i]);
+    }
+
+    /* New paths have to be matched against the current search. If it's
+     * still scanning, they are scanned by continue_paths_search(). */
+    start_scanner(&search_ctx);
+
+    return paths_l;
+}
+
+size_t get_paths_count(void)
+{
+    return paths_l;
+}
+
+/*
+ * Check if a pattern has upper case letters that are not part of escapes
+ */
+static int has_upper(const char *pattern)
+{
+    for (const char *c = pattern; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0')
+            c++;
+        else if (isupper((unsigned char)*c))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int has_non_ascii(const char *pattern)
+{
+    for (const char *c = pattern; *c != '\0'; c++) {
+        if ((unsigned char)*c >= 0x80)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * strstr() that ignores case of letters in s. Pattern has no upper case
+ * letters. Matches can only start at either case of its first character,
+ * which are skipped to with strchr() or strpbrk().
+ */
+static int has_substring_icase(const char *s, const char *pattern)
+{
+    char first[] = { pattern[0], toupper((unsigned char)pattern[0]), '\0' };
+    size_t i;
+
+    if (pattern[0] == '\0')
+        return 1;
+
+    while ((s = first[1] == first[0] ? strchr(s, first[0]) : strpbrk(s, first)) != NULL) {
+        for (i = 1; pattern[i] != '\0'
+                && tolower((unsigned char)s[i]) == (unsigned char)pattern[i]; i++)
+            ;
+        if (pattern[i] == '\0')
+            return 1;
+        s++;
+    }
+
+    return 0;
+}
+
+static int init_search_ctx(SearchContext *ctx, char *pattern, enum SearchDir dir)
+{
+    int ret;
+
+    assert(!ctx->init);
+
+    ctx->pattern = strdup(pattern);
+
+    /* Patterns without special characters are searched as plain strings,
+     * which is much faster than regexec() */
+    ctx->literal = strpbrk(ctx->pattern, REGEX_META_CHARS) == NULL;
+    ctx->icase = !has_upper(ctx->pattern);
+
+    if (!ctx->literal && (ret = compile_regex(&ctx->reg, ctx->pattern, ctx->icase)) != 0) {
+        free(ctx->pattern);
+        return ret;
+    }
+
+    /* Perform search by full path if pattern contains DIR_DELIM */
+    ctx->full_path = strchr(ctx->pattern, sep) != NULL;
+
+    ctx->dir = dir;
+    ctx->init = 1;
+
+    ctx->matches = NULL;
+    ctx->matches_l = 0;
+    ctx->scanned = NULL;
+    ctx->scanned_l = 0;
+    ctx->scan_end = 0;
+    ctx->scanners_l = 0;
+    ctx->scanning = 0;
+    ctx->scan_failed = 0;
+
+    ctx->filter = NULL;
+    ctx->filter_scanned = NULL;
+    ctx->filter_l = 0;
+
+    ctx->ranked = NULL;
+    ctx->ranks = NULL;
+    ctx->matches_count = 0;
+
+    return 0;
+}
+
+/*
+ * Match a string against the pattern. Returns the same values as regexec().
+ * Patterns without upper case letters ignore case.
+ */
+static int match_string(SearchContext *ctx, const char *s)
+{
+    if (ctx->literal && ctx->icase)
+        return has_substring_icase(s, ctx->pattern) ? 0 : REG_NOMATCH;
+    if (ctx->literal)
+        return strstr(s, ctx->pattern) != NULL ? 0 : REG_NOMATCH;
+
+    return exec_regex(&ctx->reg, s);
+}
+
+static int is_filtered_out(SearchContext *ctx, size_t i)
+{
+    size_t k = i >> SCAN_CHUNK_BITS;
+
+    return k < ctx->filter_l && (i & SCAN_CHUNK_MASK) < ctx->filter_scanned[k]
+        && !(ctx->filter[i / 64] >> (i % 64) & 1);
+}
+
+/*
+ * Match chunks of paths below scan_end against the pattern. Paths are read
+ * without the lock: they never move and their lines never change. Every
+ * chunk is scanned by one job, so only its job touches its bits.
+ */
+static void *scan_paths_job(void *arg)
+{
+    SearchContext *ctx = arg;
+    PathWalk walk = { .buf = NULL, .stack = NULL };
+    size_t k, i, chunk_start, chunk_end;
+    char *s;
+    int ret;
+    Path *p;
+
+    while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        k = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED);
+        chunk_start = k << SCAN_CHUNK_BITS;
+        if (chunk_start >= ctx->scan_end)
+            break;
+
+        chunk_end = MIN(ctx->scan_end, chunk_start + SCAN_CHUNK_SIZE);
+        for (i = chunk_start + ctx->scanned[k]; i < chunk_end; i++) {
+            if (i % SCAN_BATCH_SIZE == 0) {
+                __atomic_store_n(&ctx->scanned[k], i - chunk_start, __ATOMIC_RELEASE);
+                if (__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED))
+                    break;
+            }
+
+            if (is_filtered_out(ctx, i))
+                continue;
+
+            p = get_path_from_link((PathLink){ i });
+            s = ctx->full_path ? walk_full_path(&walk, p) : p->line;
+            ret = match_string(ctx, s);
+
+            if (ret == 0) {
+                __atomic_fetch_or(&ctx->matches[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELAXED);
+            } else if (ret != REG_NOMATCH) {
+                /* Leave the path to be matched on demand, so the error is
+                 * reported */
+                __atomic_store_n(&ctx->scan_failed, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+
+        __atomic_store_n(&ctx->scanned[k], i - chunk_start, __ATOMIC_RELEASE);
+    }
+
+    free_path_walk(&walk);
+
+    /* Matches are counted once the last job is done */
+    if (__atomic_fetch_sub(&ctx->scanning, 1, __ATOMIC_RELEASE) == 1)
+        wake_up(0);
+
+    return NULL;
+}
+
+/*
+ * Start matching paths that were not matched yet in the background.
+ * Paths must be locked.
+ */
+static void start_scanner(SearchContext *ctx)
+{
+    size_t words, chunks;
+    unsigned n;
+
+    if (!ctx->init || ctx->scan_end == paths_l || __atomic_load_n(&ctx->scanning, __ATOMIC_ACQUIRE) > 0)
+        return;
+
+    join_threads(ctx->scanners, ctx->scanners_l);
+    ctx->scanners_l = 0;
+
+    /* Paths were added, matches are ranked again once they are all matched */
+    free(ctx->ranked);
+    free(ctx->ranks);
+    ctx->ranked = NULL;
+    ctx->ranks = NULL;
+
+    if (ctx->scan_failed)
+        return;
+
+    words = (paths_l + 63) / 64;
+    if (ctx->matches_l < words) {
+        ctx->matches = realloc(ctx->matches, words * sizeof(uint64_t));
+        memset(ctx->matches + ctx->matches_l, 0, (words - ctx->matches_l) * sizeof(uint64_t));
+        ctx->matches_l = words;
+    }
+
+    chunks = (paths_l + SCAN_CHUNK_SIZE - 1) >> SCAN_CHUNK_BITS;
+    if (ctx->scanned_l < chunks) {
+        ctx->scanned = realloc(ctx->scanned, chunks * sizeof(unsigned));
+        memset(ctx->scanned + ctx->scanned_l, 0, (chunks - ctx->scanned_l) * sizeof(unsigned));
+        ctx->scanned_l = chunks;
+    }
+
+    /* The last chunk of the previous round may be incomplete */
+    ctx->next_chunk = ctx->scan_end >> SCAN_CHUNK_BITS;
+    ctx->scan_end = paths_l;
+    ctx->stop = 0;
+
+    n = MIN(jobs_l, chunks - ctx->next_chunk);
+    ctx->scanning = n;
+    ctx->scanners_l = start_threads(ctx->scanners, n, scan_paths_job, ctx);
+
+    /* Paths are still matched on demand if threads can't be started */
+    if (ctx->scanners_l < n)
+        __atomic_fetch_sub(&ctx->scanning, n - ctx->scanners_l, __ATOMIC_RELEASE);
+}
+
+static void stop_scanner(SearchContext *ctx)
+{
+    __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+    join_threads(ctx->scanners, ctx->scanners_l);
+    ctx->scanners_l = 0;
+    ctx->scanning = 0;
+}
+
+static void deinit_search_ctx(SearchContext *ctx)
+{
+    assert(ctx->init);
+
+    stop_scanner(ctx);
+    free(ctx->matches);
+    free(ctx->scanned);
+    free(ctx->filter);
+    free(ctx->filter_scanned);
+    free(ctx->ranked);
+    free(ctx->ranks);
+    if (!ctx->literal)
+        free_regex(&ctx->reg);
+    free(ctx->pattern);
+    ctx->init = 0;
+}
+
+void free_paths(void)
+{
+    /* The scanner reads paths, so it is stopped first */
+    if (search_ctx.init) {
+        deinit_search_ctx(&search_ctx);
+    }
+
+    free_arena(&arena);
+    memset(path_chunks, 0, sizeof(path_chunks));
+    paths_l = 0;
+
+    root.subpaths = NULL;
+    root.subpaths_l = 0;
+    root.subpaths_cap = 0;
+    root.rows = 0;
+    root.rows_index = NULL;
+    root.indexed = 0;
+    last_row_path = NULL;
+
+    if (path_index.slots != NULL) {
+        free(path_index.slots);
+        path_index.slots = NULL;
+        path_index.cap = 0;
+    }
+
+    if (ordered != NULL) {
+        cvector_free(ordered);
+        ordered = NULL;
+    }
+
+    if (last_components != NULL) {
+        cvector_free(last_components);
+        last_components = NULL;
+    }
+
+    if (sort_buf != NULL) {
+        cvector_free(sort_buf);
+        sort_buf = NULL;
+    }
+
+    /* Components of the walk would point to freed paths */
+    free_path_walk(&full_path_walk);
+
+    if (filter_unfolded != NULL) {
+        cvector_free(filter_unfolded);
+        filter_unfolded = NULL;
+    }
+
+    deinit_paths_find();
+
+    filtered = 0;
+}
+
+/*
+ * Check if a pattern can only match paths that the current literal
+ * pattern matches, i.e. it contains the current one
+ */
+static int refines_search(SearchContext *ctx, char *pattern)
+{
+    return ctx->literal && strpbrk(pattern, REGEX_META_CHARS) == NULL
+        && (strchr(pattern, sep) != NULL) == ctx->full_path
+        && strstr(pattern, ctx->pattern) != NULL;
+}
+
+/*
+ * Narrow the filter down to paths that contain every trigram of the
+ * pattern. Paths that were not indexed are left to the filter as is.
+ */
+static void narrow_search(SearchContext *ctx)
+{
+    uint32_t *cands;
+    uint64_t *filter;
+    unsigned *filter_scanned;
+    size_t cands_l, indexed_l, chunks, i, k;
+
+    /* Trigrams are folded byte by byte, while a regex that ignores case
+     * also folds multibyte letters, e.g. 'É' matches 'é' */
+    if (ctx->icase && !ctx->literal && has_non_ascii(ctx->pattern))
+        return;
+
+    if (get_trigram_candidates(ctx->pattern, ctx->literal, &cands, &cands_l, &indexed_l) != 0)
+        return;
+
+    chunks = (indexed_l + SCAN_CHUNK_SIZE - 1) >> SCAN_CHUNK_BITS;
+    filter = calloc(MAX(chunks, 1) << (SCAN_CHUNK_BITS - 6), sizeof(uint64_t));
+    filter_scanned = malloc(MAX(chunks, 1) * sizeof(unsigned));
+
+    for (i = 0; i < cands_l; i++) {
+        if (!is_filtered_out(ctx, cands[i]))
+            filter[cands[i] / 64] |= (uint64_t)1 << (cands[i] % 64);
+    }
+
+    for (k = 0; k < chunks; k++)
+        filter_scanned[k] = MIN(SCAN_CHUNK_SIZE, indexed_l - (k << SCAN_CHUNK_BITS));
+
+    free(cands);
+    free(ctx->filter);
+    free(ctx->filter_scanned);
+    ctx->filter = filter;
+    ctx->filter_scanned = filter_scanned;
+    ctx->filter_l = chunks;
+}
+
+int init_paths_search(char *pattern, enum SearchDir dir)
+{
+    uint64_t *filter = NULL;
+    unsigned *filter_scanned = NULL;
+    size_t filter_l = 0;
+    int ret;
+
+    if (search_ctx.init) {
+        /* Results of the current search are final once it's stopped */
+        stop_scanner(&search_ctx);
+        if (refines_search(&search_ctx, pattern)) {
+            filter = search_ctx.matches;
+            filter_scanned = search_ctx.scanned;
+            filter_l = search_ctx.scanned_l;
+            search_ctx.matches = NULL;
+            search_ctx.scanned = NULL;
+        }
+        deinit_search_ctx(&search_ctx);
+    }
+
+    if ((ret = init_search_ctx(&search_ctx, pattern, dir)) != 0) {
+        REGEX_ERR_HANDLER(ret);
+        free(filter);
+        free(filter_scanned);
+        return 1;
+    }
+
+    search_ctx.filter = filter;
+    search_ctx.filter_scanned = filter_scanned;
+    search_ctx.filter_l = filter_l;
+
+    /* Only names of paths are indexed */
+    if (!search_ctx.full_path)
+        narrow_search(&search_ctx);
+
+    start_scanner(&search_ctx);
+
+    return 0;
+}
+
+/*
+ * Match paths that were added while the previous scan was running. Scanners
+ * don't pick up new paths, so this is called when the last one is done.
+ * Paths must be locked.
+ */
+void continue_paths_search(void)
+{
+    start_scanner(&search_ctx);
+}
+
+void deinit_paths_search(void)
+{
+    if (search_ctx.init) {
+        deinit_search_ctx(&search_ctx);
+    }
+}
+
+/*
+ * Returns 1 if the path matched in the background, 0 if it did not and -1
+ * if it was not scanned yet
+ */
+static int get_scanned_match(SearchContext *ctx, size_t i)
+{
+    size_t k = i >> SCAN_CHUNK_BITS;
+
+    if (k >= ctx->scanned_l || (i & SCAN_CHUNK_MASK) >= __atomic_load_n(&ctx->scanned[k], __ATOMIC_ACQUIRE))
+        return -1;
+
+    return __atomic_load_n(&ctx->matches[i / 64], __ATOMIC_RELAXED) >> (i % 64) & 1;
+}
+
+/*
+ * Match a path against the pattern, the same way regexec() does. Full
+ * paths are built in the walk, so it's safe to call from any job.
+ */
+static int match_path(SearchContext *ctx, PathLink link, PathWalk *walk)
+{
+    Path *path;
+    char *s;
+
+    switch (get_scanned_match(ctx, link.index)) {
+    case 1:
+        return 0;
+    case 0:
+        return REG_NOMATCH;
+    }
+
+    if (is_filtered_out(ctx, link.index))
+        return REG_NOMATCH;
+
+    path = get_path_from_link(link);
+    s = ctx->full_path ? walk_full_path(walk, path) : path->line;
+    return match_string(ctx, s);
+}
+
+/*
+ * Returns 1 if every path was matched in the background
+ */
+static int is_scan_complete(SearchContext *ctx)
+{
+    size_t k, n = 0;
+
+    if (ctx->scan_end != paths_l || ctx->scan_failed
+            || __atomic_load_n(&ctx->scanning, __ATOMIC_ACQUIRE) > 0)
+        return 0;
+
+    for (k = 0; k < ctx->scanned_l; k++)
+        n += ctx->scanned[k];
+
+    return n == paths_l;
+}
+
+static size_t count_matches(SearchContext *ctx)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < ctx->matches_l; i++)
+        n += __builtin_popcountll(__atomic_load_n(&ctx->matches[i], __ATOMIC_RELAXED));
+
+    return n;
+}
+
+/*
+ * Move matches into tree order and count them for every word, so the rank
+ * of a match is found with one popcount
+ */
+static void rank_matches(SearchContext *ctx)
+{
+    size_t words = (paths_l + 63) / 64, i, pos, n = 0;
+    uint64_t word;
+
+    ctx->ranked = calloc(MAX(words, 1), sizeof(uint64_t));
+    ctx->ranks = malloc(MAX(words, 1) * sizeof(size_t));
+
+    for (i = 0; i < ctx->matches_l; i++) {
+        for (word = ctx->matches[i]; word != 0; word &= word - 1) {
+            pos = get_path_from_link((PathLink){ i * 64 + __builtin_ctzll(word) })->order;
+            ctx->ranked[pos / 64] |= (uint64_t)1 << (pos % 64);
+        }
+    }
+
+    for (i = 0; i < words; i++) {
+        ctx->ranks[i] = n;
+        n += __builtin_popcountll(ctx->ranked[i]);
+    }
+
+    ctx->matches_count = n;
+}
+
+/*
+ * Get the number of matches of the search and the number of the path
+ * among them in tree order, 0 if it doesn't match. Until all paths are
+ * matched, complete is 0 and count is the number of matches so far.
+ * Returns 1 if there is no search or it can't be counted because a path
+ * failed to match. Paths must be locked.
+ */
+int get_match_rank(Path *path, size_t *rank, size_t *count, int *complete)
+{
+    SearchContext *ctx = &search_ctx;
+    size_t pos = path->order;
+    uint64_t word, before;
+
+    if (!ctx->init || ctx->scan_failed)
+        return 1;
+
+    if (ctx->ranks == NULL) {
+        if (order_stale || !is_scan_complete(ctx)) {
+            *rank = 0;
+            *count = count_matches(ctx);
+            *complete = 0;
+            return 0;
+        }
+        rank_matches(ctx);
+    }
+
+    /* Matches before the path in its word */
+    word = ctx->ranked[pos / 64];
+    before = word & (((uint64_t)1 << (pos % 64)) - 1);
+
+    *rank = word >> (pos % 64) & 1 ? ctx->ranks[pos / 64] + __builtin_popcountll(before) + 1 : 0;
+
+    *count = ctx->matches_count;
+    *complete = 1;
+    return 0;
+}
+
+enum MatchStatus path_match_pattern(Path *path)
+{
+    int ret;
+
+    if (!search_ctx.init)
+        return MatchStatusFail;
+
+    ret = match_path(&search_ctx, get_path_link(path), &full_path_walk);
+
+    if (ret == 0)
+        return MatchStatusOk;
+
+    if (ret == REG_NOMATCH) {
+        return MatchStatusFail;
+    }
+
+    REGEX_ERR_HANDLER(ret);
+    return MatchStatusErr;
+}
+
+static void *search_job(void *arg)
+{
+    SearchTask *t = arg;
+    PathWalk walk = { .buf = NULL, .stack = NULL };
+    long d, end, found;
+    PathLink link;
+    int ret;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_RELAXED)) {
+        d = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED) * SEARCH_CHUNK_SIZE;
+
+        /* Chunks past the nearest match can't contain a nearer one */
+        if (d >= __atomic_load_n(&t->found, __ATOMIC_RELAXED))
+            break;
+
+        end = MIN(d + SEARCH_CHUNK_SIZE, t->count);
+        for (; d < end; d++) {
+            if (d % SCAN_BATCH_SIZE == 0 && __atomic_load_n(&t->stop, __ATOMIC_RELAXED))
+                break;
+
+            link = ordered[t->start + d * t->dir];
+
+            /* Paths that are hidden by the filter are not searched */
+            if (get_path_from_link(link)->hidden)
+                continue;
+
+            ret = match_path(&search_ctx, link, &walk);
+
+            if (ret == 0) {
+                found = __atomic_load_n(&t->found, __ATOMIC_RELAXED);
+                while (d < found && !__atomic_compare_exchange_n(&t->found, &found, d, 0,
+                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    ;
+                break;
+            } else if (ret != REG_NOMATCH) {
+                __atomic_store_n(&t->ret, ret, __ATOMIC_RELAXED);
+                __atomic_store_n(&t->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    free_path_walk(&walk);
+
+    __atomic_fetch_sub(&t->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Find the nearest match in the search direction. Long searches are split
+ * between jobs, while the calling thread polls the cancelled callback.
+ * It's expected to wait a bit for user input before it returns.
+ */
+int search_path(Path **match, Path *start, int invert_dir, int (*cancelled)(void))
+{
+    pthread_t threads[MAX_JOBS];
+    SearchTask t;
+    unsigned n, started;
+    int cancel = 0;
+
+    if (!search_ctx.init) {
+        set_error("Search query was not given");
+        return 1;
+    }
+
+    t.dir = search_ctx.dir;
+    if (invert_dir)
+        t.dir *= -1;
+
+    /* Paths are searched in the order they appear in the tree */
+    update_paths_order();
+
+    t.start = start->order + t.dir;
+    t.count = t.dir > 0 ? (long)cvector_size(ordered) - t.start : t.start + 1;
+    t.next = 0;
+    t.found = t.count;
+    t.ret = 0;
+    t.stop = 0;
+
+    if (t.count <= SEARCH_CHUNK_SIZE) {
+        t.running = 1;
+        search_job(&t);
+    } else {
+        n = MIN(jobs_l, (t.count + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE);
+        t.running = n;
+        started = start_threads(threads, n, search_job, &t);
+        __atomic_fetch_sub(&t.running, n - started, __ATOMIC_RELEASE);
+
+        if (started == 0) {
+            t.running = 1;
+            search_job(&t);
+        }
+
+        while (cancelled != NULL && !cancel && __atomic_load_n(&t.running, __ATOMIC_ACQUIRE) > 0) {
+            if (cancelled()) {
+                __atomic_store_n(&t.stop, 1, __ATOMIC_RELAXED);
+                cancel = 1;
+            }
+        }
+
+        join_threads(threads, started);
+    }
+
+    if (cancel) {
+        set_error("Search was cancelled");
+        return 1;
+    }
+
+    if (t.ret != 0) {
+        REGEX_ERR_HANDLER(t.ret);
+        return 1;
+    }
+
+    *match = t.found < t.count ? get_path_from_link(ordered[t.start + t.found * t.dir]) : NULL;
+    return 0;
+}
+
+/*
+ * Rows of all directories are counted from scratch. Subpaths come after
+ * their mainpath in tree order, so going backwards, every path is counted
+ * after its subpaths.
+ */
+static void reset_rows(void)
+{
+    for (size_t i = 0; i < cvector_size(ordered); i++)
+        get_path_from_link(ordered[i])->rows = 0;
+
+    root.rows = 0;
+    root.indexed = 0;
+    last_row_path = NULL;
+}
+
+static void count_path_rows(Path *p)
+{
+    get_mainpath(p)->rows += get_path_weight(p);
+    p->indexed = 0;
+}
+
+static void refold_filtered_paths(void)
+{
+    for (size_t i = 0; i < cvector_size(filter_unfolded); i++)
+        filter_unfolded[i]->state = PathStateFolded;
+
+    cvector_set_size(filter_unfolded, 0);
+}
+
+/*
+ * Show only paths that match the search and their mainpaths, which are
+ * unfolded. Whether a subtree contains a match is found in one pass from
+ * the bottom of the tree: a path is shown if it matches or if any of its
+ * subpaths is shown, i.e. it has rows.
+ */
+int filter_paths(int (*cancelled)(void))
+{
+    Path *p;
+    size_t i;
+    int ret;
+
+    if (!search_ctx.init) {
+        set_error("Search query was not given");
+        return 1;
+    }
+
+    /* Wait for the scanner, so most of the paths don't have to be matched
+     * here */
+    start_scanner(&search_ctx);
+    while (__atomic_load_n(&search_ctx.scanning, __ATOMIC_ACQUIRE) > 0) {
+        if (cancelled != NULL && cancelled()) {
+            set_error("Filter was cancelled");
+            return 1;
+        }
+    }
+
+    refold_filtered_paths();
+    update_paths_order();
+    reset_rows();
+
+    for (i = cvector_size(ordered); i-- > 0;) {
+        p = get_path_from_link(ordered[i]);
+
+        ret = p->rows > 0 ? 0 : match_path(&search_ctx, ordered[i], &full_path_walk);
+        if (ret != 0 && ret != REG_NOMATCH) {
+            REGEX_ERR_HANDLER(ret);
+            unfilter_paths();
+            return 1;
+        }
+
+        p->hidden = ret != 0;
+        if (p->rows > 0 && p->state == PathStateFolded) {
+            p->state = PathStateUnfolded;
+            cvector_push_back(filter_unfolded, p);
+        }
+
+        count_path_rows(p);
+    }
+
+    filtered = 1;
+
+    if (root.rows == 0) {
+        unfilter_paths();
+        set_error("Pattern not found");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Show all paths again
+ */
+void unfilter_paths(void)
+{
+    Path *p;
+
+    refold_filtered_paths();
+    update_paths_order();
+    reset_rows();
+
+    for (size_t i = cvector_size(ordered); i-- > 0;) {
+        p = get_path_from_link(ordered[i]);
+        p->hidden = 0;
+        count_path_rows(p);
+    }
+
+    filtered = 0;
+}
+
+/*
+ * Check if every character of a is found in b in the same order
+ */
+static int is_subsequence(const char *a, const char *b)
+{
+    for (; *a != '\0' && *b != '\0'; b++) {
+        if (*a == *b)
+            a++;
+    }
+
+    return *a == '\0';
+}
+
+static int fold_char(char c, int icase)
+{
+    return icase ? tolower((unsigned char)c) : (unsigned char)c;
+}
+
+/*
+ * Find the first character of s that is c, ignoring case if needed.
+ * memchr() is vectorized, so paths that don't match are skipped fast.
+ */
+static const char *find_char(const char *s, const char *end, char c, int icase)
+{
+    const char *lower, *upper;
+
+    lower = memchr(s, c, end - s);
+    if (!icase || !isalpha((unsigned char)c))
+        return lower;
+
+    upper = memchr(s, toupper((unsigned char)c), (lower != NULL ? lower : end) - s);
+    return upper != NULL ? upper : lower;
+}
+
+static int get_match_bonus(const char *s, size_t i)
+{
+    if (i == 0 || s[i - 1] == sep)
+        return BONUS_SEPARATOR;
+
+    if (strchr(WORD_DELIMS, s[i - 1]) != NULL
+            || (islower((unsigned char)s[i - 1]) && isupper((unsigned char)s[i])))
+        return BONUS_BOUNDARY;
+
+    return 0;
+}
+
+/*
+ * Score a string against a fuzzy query. Characters of the query are found
+ * as early as possible, then the match is shortened by looking for them
+ * backwards from its end. Returns 1 if the string does not match.
+ */
+static int score_string(const char *s, size_t len, const char *query, int icase, int *score)
+{
+    const char *p = s, *end = s + len;
+    size_t i, start, q_l = strlen(query);
+    int bonus, consecutive = 0, gap = 0;
+
+    *score = 0;
+    if (q_l == 0)
+        return 0;
+
+    for (i = 0; i < q_l; i++) {
+        if ((p = find_char(p, end, query[i], icase)) == NULL)
+            return 1;
+        p++;
+    }
+
+    end = p;
+    for (start = end - s, i = q_l; i > 0; ) {
+        if (fold_char(s[--start], icase) == (unsigned char)query[i - 1])
+            i--;
+    }
+
+    for (p = s + start; i < q_l; p++) {
+        if (fold_char(*p, icase) != (unsigned char)query[i]) {
+            *score += gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            gap = 1;
+            consecutive = 0;
+            continue;
+        }
+
+        bonus = get_match_bonus(s, p - s);
+        if (i == 0)
+            bonus *= BONUS_FIRST_CHAR;
+        if (consecutive)
+            bonus = MAX(bonus, BONUS_CONSECUTIVE);
+
+        *score += SCORE_MATCH + bonus;
+        consecutive = 1;
+        gap = 0;
+        i++;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a positive value if a is a better match than b. Higher scores
+ * come first, then shorter paths, then paths that were added earlier.
+ */
+static long compare_found_paths(const FoundPath *a, const FoundPath *b)
+{
+    if (a->score != b->score)
+        return a->score - b->score;
+
+    if (a->len != b->len)
+        return (long)b->len - a->len;
+
+    return (long)b->link.index - (long)a->link.index;
+}
+
+static int found_path_sort_compare(const void *a, const void *b)
+{
+    long d = compare_found_paths(b, a);
+
+    return (d > 0) - (d < 0);
+}
+
+static void push_found_path(FindJob *j, FoundPath fp)
+{
+    FoundPath *h = j->heap;
+    size_t i, c;
+
+    if (j->heap_l < MAX_FOUND_PATHS) {
+        for (i = j->heap_l++; i > 0 && compare_found_paths(&h[(i - 1) / 2], &fp) > 0; i = (i - 1) / 2)
+            h[i] = h[(i - 1) / 2];
+        h[i] = fp;
+        return;
+    }
+
+    if (compare_found_paths(&fp, &h[0]) <= 0)
+        return;
+
+    /* Replace the worst match and sift it down */
+    for (i = 0; (c = i * 2 + 1) < j->heap_l; i = c) {
+        if (c + 1 < j->heap_l && compare_found_paths(&h[c], &h[c + 1]) > 0)
+            c++;
+        if (compare_found_paths(&fp, &h[c]) <= 0)
+            break;
+        h[i] = h[c];
+    }
+    h[i] = fp;
+}
+
+static void *find_job(void *arg)
+{
+    FindJob *j = arg;
+    FindTask *t = j->task;
+    PathWalk walk = { .buf = NULL, .stack = NULL };
+    size_t i, end, len, n = 0, matched_l = 0;
+    uint64_t word;
+    int score;
+    char *s;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_RELAXED)) {
+        i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED) * FIND_CHUNK_SIZE;
+        if (i >= t->end)
+            break;
+
+        end = MIN(i + FIND_CHUNK_SIZE, t->end);
+        for (; i < end; i++) {
+            if (++n % SCAN_BATCH_SIZE == 0 && __atomic_load_n(&t->stop, __ATOMIC_RELAXED))
+                break;
+
+            /* Go straight to the next path that matched the previous
+             * query */
+            if (i < t->candidates_end) {
+                word = t->candidates[i / 64] >> (i % 64);
+                if (word == 0) {
+                    i = MIN(i | 63, t->candidates_end - 1);
+                    continue;
+                }
+                i += __builtin_ctzll(word);
+            }
+
+            s = walk_full_path(&walk, get_path_from_link((PathLink){ i }));
+            len = strlen(s);
+            if (score_string(s, len, t->query, t->icase, &score) != 0)
+                continue;
+
+            t->matched[i / 64] |= (uint64_t)1 << (i % 64);
+            matched_l++;
+            push_found_path(j, (FoundPath){ score, len, { i } });
+        }
+    }
+
+    free_path_walk(&walk);
+
+    __atomic_fetch_add(&t->matched_l, matched_l, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&t->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Rank all paths by how well their full paths match a fuzzy query. The
+ * query is matched ignoring case unless it has upper case characters.
+ * Jobs score paths while the calling thread polls the cancelled callback.
+ */
+int find_paths(char *query, int (*cancelled)(void))
+{
+    pthread_t threads[MAX_JOBS];
+    FindJob *jobs;
+    FindTask t;
+    char *q;
+    unsigned n, i, started = 0;
+    int cancel = 0;
+
+    q = strdup(query);
+    t.icase = 1;
+    for (char *c = q; *c != '\0'; c++) {
+        if (isupper((unsigned char)*c))
+            t.icase = 0;
+    }
+
+    t.query = q;
+    t.next = 0;
+    t.end = paths_l;
+    t.matched = calloc((paths_l + 63) / 64, sizeof(uint64_t));
+    t.matched_l = 0;
+    t.stop = 0;
+
+    /* A query that contains the previous one can only match its matches */
+    if (find_query != NULL && is_subsequence(find_query, q)) {
+        t.candidates = find_matches;
+        t.candidates_end = find_matches_end;
+    } else {
+        t.candidates = NULL;
+        t.candidates_end = 0;
+    }
+
+    n = MIN(jobs_l, (paths_l + FIND_CHUNK_SIZE - 1) / FIND_CHUNK_SIZE);
+    n = MAX(n, 1);
+    jobs = malloc(n * sizeof(FindJob));
+    t.running = n;
+
+    for (i = 0; i < n; i++) {
+        jobs[i].task = &t;
+        jobs[i].heap_l = 0;
+    }
+
+    if (n > 1) {
+        for (started = 0; started < n; started++) {
+            if (start_threads(&threads[started], 1, find_job, &jobs[started]) == 0)
+                break;
+        }
+        __atomic_fetch_sub(&t.running, n - started, __ATOMIC_RELEASE);
+    }
+
+    if (started == 0) {
+        t.running = 1;
+        find_job(&jobs[0]);
+    }
+
+    while (cancelled != NULL && !cancel && __atomic_load_n(&t.running, __ATOMIC_ACQUIRE) > 0) {
+        if (cancelled()) {
+            __atomic_store_n(&t.stop, 1, __ATOMIC_RELAXED);
+            cancel = 1;
+        }
+    }
+
+    join_threads(threads, started);
+
+    if (cancel) {
+        free(jobs);
+        free(t.matched);
+        free(q);
+        set_error("Search was cancelled");
+        return 1;
+    }
+
+    cvector_set_size(found, 0);
+    for (i = 0; i < n; i++) {
+        for (size_t k = 0; k < jobs[i].heap_l; k++)
+            cvector_push_back(found, jobs[i].heap[k]);
+    }
+    free(jobs);
+
+    qsort(found, cvector_size(found), sizeof(FoundPath), found_path_sort_compare);
+    cvector_set_size(found, MIN(cvector_size(found), MAX_FOUND_PATHS));
+    found_matches_l = t.matched_l;
+
+    free(find_query);
+    free(find_matches);
+    find_query = q;
+    find_matches = t.matched;
+    find_matches_end = t.end;
 
-    *match = NO_LINK;
     return 0;
 }
+
+/*
+ * Get the i-th best match of the last fuzzy query
+ */
+Path *get_found_path(size_t i)
+{
+    return i < cvector_size(found) ? get_path_from_link(found[i].link) : NULL;
+}
+
+/*
+ * Number of the best matches that are kept
+ */
+size_t get_found_paths_count(void)
+{
+    return cvector_size(found);
+}
+
+/*
+ * Number of all paths that matched the last fuzzy query
+ */
+size_t get_found_matches_count(void)
+{
+    return found_matches_l;
+}
+
+void deinit_paths_find(void)
+{
+    if (found != NULL) {
+        cvector_free(found);
+        found = NULL;
+    }
+
+    found_matches_l = 0;
+
+    free(find_query);
+    free(find_matches);
+    find_query = NULL;
+    find_matches = NULL;
+    find_matches_end = 0;
+}
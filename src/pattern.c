@@ -0,0 +1,130 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "pattern.h"
+
+#ifdef PCRE2
+
+/* Match data can't be shared between threads, so every thread that
+ * matches gets its own */
+static pthread_key_t match_data_key;
+static pthread_once_t match_data_once = PTHREAD_ONCE_INIT;
+static int match_data_key_ret = 0;
+
+static void free_match_data(void *md)
+{
+    pcre2_match_data_free(md);
+}
+
+static void init_match_data_key(void)
+{
+    match_data_key_ret = pthread_key_create(&match_data_key, free_match_data);
+}
+
+/*
+ * Returns NULL if there is not enough memory
+ */
+static pcre2_match_data *get_match_data(void)
+{
+    pcre2_match_data *md;
+
+    pthread_once(&match_data_once, init_match_data_key);
+    if (match_data_key_ret != 0)
+        return NULL;
+
+    if ((md = pthread_getspecific(match_data_key)) == NULL) {
+        md = pcre2_match_data_create(1, NULL);
+        if (md != NULL && pthread_setspecific(match_data_key, md) != 0) {
+            pcre2_match_data_free(md);
+            md = NULL;
+        }
+    }
+
+    return md;
+}
+
+int compile_regex(Regex *re, const char *pattern, int icase)
+{
+    PCRE2_SIZE offset;
+    int ret;
+
+    re->code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                             icase ? PCRE2_CASELESS : 0, &ret, &offset, NULL);
+    if (re->code == NULL)
+        return ret;
+
+    /* Patterns are matched by the interpreter if JIT is not available */
+    pcre2_jit_compile(re->code, PCRE2_JIT_COMPLETE);
+
+    return 0;
+}
+
+int exec_regex(Regex *re, const char *s)
+{
+    pcre2_match_data *md = get_match_data();
+    int ret;
+
+    /* Reported as "no more memory" by get_regex_error() */
+    if (md == NULL)
+        return PCRE2_ERROR_NOMEMORY;
+
+    ret = pcre2_match(re->code, (PCRE2_SPTR)s, PCRE2_ZERO_TERMINATED, 0, 0, md, NULL);
+
+    if (ret >= 0)
+        return 0;
+
+    return ret == PCRE2_ERROR_NOMATCH ? REG_NOMATCH : ret;
+}
+
+void get_regex_error(Regex *re, int ret, char *buf, size_t size)
+{
+    if (pcre2_get_error_message(ret, (PCRE2_UCHAR *)buf, size) == PCRE2_ERROR_BADDATA)
+        snprintf(buf, size, "error %d", ret);
+}
+
+void free_regex(Regex *re)
+{
+    pcre2_code_free(re->code);
+}
+
+#else
+
+int compile_regex(Regex *re, const char *pattern, int icase)
+{
+    return regcomp(&re->reg, pattern, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0));
+}
+
+int exec_regex(Regex *re, const char *s)
+{
+    return regexec(&re->reg, s, 0, NULL, 0);
+}
+
+void get_regex_error(Regex *re, int ret, char *buf, size_t size)
+{
+    regerror(ret, &re->reg, buf, size);
+}
+
+void free_regex(Regex *re)
+{
+    regfree(&re->reg);
+}
+
+#endif
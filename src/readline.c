@@ -176,8 +176,10 @@ void readline_send(ReadlineCtx *ctx, ReadlineEvent ev)
         insert_char(ctx, ev.ch);
         break;
     case ReadlineBackspace:
-        del_char(ctx, ctx->cursor);
-        ctx->cursor--;
+        if (ctx->cursor > 0) {
+            del_char(ctx, ctx->cursor);
+            ctx->cursor--;
+        }
         break;
     case ReadlineDelete:
         del_char(ctx, ctx->cursor + 1);
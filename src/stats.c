@@ -0,0 +1,131 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "utils.h"
+#include "version.h"
+
+/* Descriptor of /proc/self/io, -2 if it was not opened yet */
+static int io_fd = -2;
+
+void record_timing(Timing *timing, long start_us)
+{
+    timing->last_us = get_time_us() - start_us;
+    timing->max_us = MAX(timing->max_us, timing->last_us);
+    timing->total_us += timing->last_us;
+    timing->count++;
+}
+
+/*
+ * Get the number of bytes the process has written so far, other than
+ * wake-ups of the main loop, or -1 if the kernel doesn't tell it. Threads
+ * may wake up the loop between the two reads, so it can be off by a byte.
+ */
+long get_written_bytes(void)
+{
+    char buf[512], *s;
+    ssize_t n;
+
+    if (io_fd == -2)
+        io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (io_fd == -1)
+        return -1;
+
+    n = pread(io_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    s = strstr(buf, "wchar:");
+    if (s == NULL)
+        return -1;
+
+    return strtol(s + strlen("wchar:"), NULL, 10) - get_wakeup_written();
+}
+
+static void format_timing(char *line, char *name, Timing *timing)
+{
+    long avg_us = timing->count > 0 ? timing->total_us / (long)timing->count : 0;
+
+    snprintf(line, STATS_LINE_LEN, "%-8s%9.3f  avg %8.3f  max %8.3f ms", name,
+             timing->last_us / 1000.0, avg_us / 1000.0, timing->max_us / 1000.0);
+}
+
+/*
+ * Format stats as lines of the overlay and of the stats file
+ */
+void format_stats(Stats *stats, char lines[STATS_LINES_L][STATS_LINE_LEN])
+{
+    size_t i = 0;
+
+    snprintf(lines[i++], STATS_LINE_LEN, "frames  %9zu", stats->frames);
+    format_timing(lines[i++], "input", &stats->input);
+    format_timing(lines[i++], "draw", &stats->draw);
+    format_timing(lines[i++], "present", &stats->present);
+    format_timing(lines[i++], "fold", &stats->fold);
+    format_timing(lines[i++], "search", &stats->search);
+    format_timing(lines[i++], "find", &stats->find);
+
+    if (stats->written < 0) {
+        snprintf(lines[i++], STATS_LINE_LEN, "written       n/a");
+    } else {
+        snprintf(lines[i++], STATS_LINE_LEN, "written %9ld B  total %ld B", stats->written,
+                 stats->total_written);
+    }
+
+    snprintf(lines[i++], STATS_LINE_LEN, "paths   %9zu  total %zu", stats->visible_paths_l,
+             stats->total_paths_l);
+}
+
+int write_stats(const char *filename, Stats *stats)
+{
+    char lines[STATS_LINES_L][STATS_LINE_LEN];
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        set_errorf("failed to open %s: %s", filename, strerror(errno));
+        return 1;
+    }
+
+    fprintf(f, "ictree v%s\n", VERSION);
+
+    format_stats(stats, lines);
+    for (size_t i = 0; i < STATS_LINES_L; i++)
+        fprintf(f, "%s\n", lines[i]);
+
+    if (fclose(f) != 0) {
+        set_errorf("failed to write %s: %s", filename, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+void close_stats(void)
+{
+    if (io_fd >= 0)
+        close(io_fd);
+    io_fd = -2;
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright 2022 Nikita Ivanov
+ *
+ * This file is part of ictree
+ *
+ * ictree is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ictree is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ictree. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "paths.h"
+#include "trigrams.h"
+#include "utils.h"
+
+#define MIN_TRIGRAM_SLOTS 4096
+
+/* Trigrams of a pattern past that number are not looked up */
+#define MAX_PATTERN_TRIGRAMS 64
+
+/* Number of paths indexed before a stop request is checked */
+#define INDEX_BATCH_SIZE 65536
+
+/*
+ * Paths that contain a trigram are stored in postings[start, start + count).
+ * Trigrams consist of characters other than '\0', so key 0 marks an empty
+ * slot.
+ */
+typedef struct TrigramSlot {
+    uint32_t key;
+    uint32_t count;
+    uint32_t last; /* Index + 1 of the last path that was counted */
+    size_t start;
+} TrigramSlot;
+
+typedef struct TrigramIndex {
+    TrigramSlot *slots;
+    size_t slots_l;
+    size_t cap;
+    uint32_t *postings;
+    size_t postings_l;
+    TrigramIndexStats stats;
+} TrigramIndex;
+
+/* The index is built by the loader and used by search once it's ready.
+ * Both happen with paths locked. */
+static TrigramIndex index_ = { .slots = NULL };
+static int index_ready = 0;
+
+static size_t hash_trigram(uint32_t key, size_t cap)
+{
+    return (key * 2654435761u) & (cap - 1);
+}
+
+static TrigramSlot *find_slot(TrigramIndex *ix, uint32_t key)
+{
+    size_t i;
+
+    for (i = hash_trigram(key, ix->cap); ix->slots[i].key != 0; i = (i + 1) & (ix->cap - 1)) {
+        if (ix->slots[i].key == key)
+            break;
+    }
+
+    return &ix->slots[i];
+}
+
+static void grow_slots(TrigramIndex *ix)
+{
+    TrigramSlot *old = ix->slots;
+    size_t old_cap = ix->cap;
+
+    ix->cap = MAX(MIN_TRIGRAM_SLOTS, old_cap * 2);
+    ix->slots = calloc(ix->cap, sizeof(TrigramSlot));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key != 0)
+            *find_slot(ix, old[i].key) = old[i];
+    }
+
+    free(old);
+}
+
+static TrigramSlot *insert_slot(TrigramIndex *ix, uint32_t key)
+{
+    TrigramSlot *slot;
+
+    if ((ix->slots_l + 1) * 2 > ix->cap)
+        grow_slots(ix);
+
+    slot = find_slot(ix, key);
+    if (slot->key == 0) {
+        slot->key = key;
+        ix->slots_l++;
+    }
+
+    return slot;
+}
+
+/*
+ * Trigrams are folded to lower case, so they serve searches that ignore
+ * case as well
+ */
+static uint32_t push_trigram_char(uint32_t key, char c)
+{
+    return ((key << 8) | tolower((unsigned char)c)) & 0xffffff;
+}
+
+static size_t get_index_size(TrigramIndex *ix)
+{
+    return ix->cap * sizeof(TrigramSlot) + ix->postings_l * sizeof(uint32_t);
+}
+
+static int is_stopped(int *stop, size_t i)
+{
+    return i % INDEX_BATCH_SIZE == 0 && __atomic_load_n(stop, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count paths that contain every trigram of their line until the index
+ * takes more than max_size. Returns the number of paths that were counted.
+ */
+static size_t count_trigrams(TrigramIndex *ix, size_t paths_l, size_t max_size, int *stop)
+{
+    TrigramSlot *slot;
+    uint32_t key;
+    size_t i;
+    char *line, *c;
+
+    for (i = 0; i < paths_l; i++) {
+        if (is_stopped(stop, i) || get_index_size(ix) > max_size)
+            break;
+
+        key = 0;
+        line = get_path_from_link((PathLink){ i })->line;
+        for (c = line; *c != '\0'; c++) {
+            key = push_trigram_char(key, *c);
+            if (c - line < 2)
+                continue;
+
+            slot = insert_slot(ix, key);
+            if (slot->last != i + 1) {
+                slot->last = i + 1;
+                slot->count++;
+                ix->postings_l++;
+            }
+        }
+    }
+
+    return i;
+}
+
+static void fill_postings(TrigramIndex *ix, size_t paths_l)
+{
+    TrigramSlot *slot;
+    uint32_t key;
+    size_t i, start = 0;
+    char *line, *c;
+
+    for (i = 0; i < ix->cap; i++) {
+        ix->slots[i].start = start;
+        start += ix->slots[i].count;
+        ix->slots[i].count = 0;
+        ix->slots[i].last = 0;
+    }
+
+    for (i = 0; i < paths_l; i++) {
+        key = 0;
+        line = get_path_from_link((PathLink){ i })->line;
+        for (c = line; *c != '\0'; c++) {
+            key = push_trigram_char(key, *c);
+            if (c - line < 2)
+                continue;
+
+            slot = find_slot(ix, key);
+            if (slot->last != i + 1) {
+                slot->last = i + 1;
+                ix->postings[slot->start + slot->count++] = i;
+            }
+        }
+    }
+}
+
+static void free_index(TrigramIndex *ix)
+{
+    free(ix->slots);
+    free(ix->postings);
+    ix->slots = NULL;
+    ix->postings = NULL;
+}
+
+/*
+ * Index trigrams of path lines, so that search only matches paths that
+ * contain every trigram of the pattern. Lines don't change once they are
+ * loaded, so they are read without the lock. Paths past max_size bytes of
+ * the index are not indexed and are always matched.
+ */
+int build_trigram_index(size_t paths_l, size_t max_size, int *stop)
+{
+    TrigramIndex ix = { .slots = NULL, .slots_l = 0, .cap = 0, .postings = NULL, .postings_l = 0 };
+    long start_ms = get_time_ms();
+
+    grow_slots(&ix);
+
+    ix.stats.paths_l = count_trigrams(&ix, paths_l, max_size, stop);
+    if (__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+        free_index(&ix);
+        return 1;
+    }
+
+    ix.postings = malloc(MAX(ix.postings_l, 1) * sizeof(uint32_t));
+    fill_postings(&ix, ix.stats.paths_l);
+
+    ix.stats.size = get_index_size(&ix);
+    ix.stats.time_ms = get_time_ms() - start_ms;
+
+    lock_paths();
+    index_ = ix;
+    index_ready = 1;
+    unlock_paths();
+
+    return 0;
+}
+
+static size_t get_literal_trigrams(const char *s, uint32_t *keys)
+{
+    uint32_t key = 0;
+    size_t keys_l = 0;
+
+    for (const char *c = s; *c != '\0' && keys_l < MAX_PATTERN_TRIGRAMS; c++) {
+        key = push_trigram_char(key, *c);
+        if (c - s >= 2)
+            keys[keys_l++] = key;
+    }
+
+    return keys_l;
+}
+
+/*
+ * Skip a bracket expression. Returns its last character.
+ */
+static const char *skip_bracket(const char *p)
+{
+    char close;
+
+    p++;
+    p += *p == '^';
+    p += *p == ']';
+
+    for (; *p != '\0' && *p != ']'; p++) {
+#ifdef PCRE2
+        /* Brackets may be escaped as well */
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            continue;
+        }
+#endif
+        /* Classes like [:alpha:] end with their own bracket */
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            close = p[1];
+            for (p += 2; *p != '\0' && !(*p == close && p[1] == ']'); p++)
+                ;
+            if (*p == '\0')
+                break;
+            p++;
+        }
+    }
+
+    return *p == '\0' ? p - 1 : p;
+}
+
+static int is_optional(const char *quantifier)
+{
+    return *quantifier == '*' || *quantifier == '?' || *quantifier == '{';
+}
+
+/*
+ * Collect trigrams of strings that every match of an extended regular
+ * expression contains. Only simple patterns are handled: patterns with
+ * alternatives give no trigrams, groups are skipped, and characters with
+ * a quantifier break strings.
+ */
+static size_t get_regex_trigrams(const char *p, uint32_t *keys)
+{
+    uint32_t key = 0;
+    size_t keys_l = 0, run_l = 0;
+    int depth = 0;
+    char c;
+
+    if (strchr(p, '|') != NULL)
+        return 0;
+
+    for (; *p != '\0' && keys_l < MAX_PATTERN_TRIGRAMS; p++) {
+        c = *p;
+
+        switch (c) {
+        case '\\':
+#ifdef PCRE2
+            /* Escapes like \x2e or \101 take arguments, so it's not known
+             * what the rest matches */
+            if (isalnum((unsigned char)p[1]))
+                return keys_l;
+#endif
+            if (p[1] == '\0' || isalnum((unsigned char)p[1]) || strchr("<>`'", p[1]) != NULL) {
+                /* GNU escapes like \w or \< match classes and anchors */
+                run_l = 0;
+                p += p[1] != '\0';
+                continue;
+            }
+            c = *++p;
+            break;
+        case '[':
+            run_l = 0;
+            p = skip_bracket(p);
+            continue;
+        case '(':
+#ifdef PCRE2
+            /* Options like (?x) change how the rest is read */
+            if (p[1] == '?')
+                return keys_l;
+#endif
+            depth++;
+            run_l = 0;
+            continue;
+        case ')':
+            depth -= depth > 0;
+            run_l = 0;
+            continue;
+        case '{':
+            while (p[1] != '\0' && p[1] != '}')
+                p++;
+            p += p[1] != '\0';
+            /* fall through */
+        case '*':
+        case '?':
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            run_l = 0;
+            continue;
+        }
+
+        if (depth > 0 || is_optional(p + 1)) {
+            run_l = 0;
+            continue;
+        }
+
+        key = push_trigram_char(key, c);
+        if (++run_l >= 3)
+            keys[keys_l++] = key;
+
+        /* Repeated character can't be followed by the next one */
+        if (p[1] == '+')
+            run_l = 0;
+    }
+
+    return keys_l;
+}
+
+static int posting_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Find indexed paths that contain every trigram of the pattern. Paths
+ * past indexed_l were not indexed and may match as well. Returns 1 if the
+ * index can't be used for the pattern. Paths must be locked.
+ */
+int get_trigram_candidates(const char *pattern, int literal, uint32_t **candidates,
+                           size_t *candidates_l, size_t *indexed_l)
+{
+    uint32_t keys[MAX_PATTERN_TRIGRAMS], *cands, *list;
+    TrigramSlot *slots[MAX_PATTERN_TRIGRAMS], *slot;
+    size_t keys_l, i, j, k, n;
+
+    if (!index_ready)
+        return 1;
+
+    keys_l = literal ? get_literal_trigrams(pattern, keys) : get_regex_trigrams(pattern, keys);
+    if (keys_l == 0)
+        return 1;
+
+    *indexed_l = index_.stats.paths_l;
+    *candidates = NULL;
+    *candidates_l = 0;
+
+    /* Lists are intersected starting from the shortest one */
+    for (i = 0; i < keys_l; i++) {
+        slot = find_slot(&index_, keys[i]);
+        if (slot->key == 0)
+            return 0;
+
+        for (j = i; j > 0 && slots[j - 1]->count > slot->count; j--)
+            slots[j] = slots[j - 1];
+        slots[j] = slot;
+    }
+
+    n = slots[0]->count;
+    cands = malloc(MAX(n, 1) * sizeof(uint32_t));
+    memcpy(cands, index_.postings + slots[0]->start, n * sizeof(uint32_t));
+
+    for (i = 1; i < keys_l && n > 0; i++) {
+        list = index_.postings + slots[i]->start;
+        for (j = 0, k = 0; j < n; j++) {
+            if (bsearch(&cands[j], list, slots[i]->count, sizeof(uint32_t), posting_compare) != NULL)
+                cands[k++] = cands[j];
+        }
+        n = k;
+    }
+
+    *candidates = cands;
+    *candidates_l = n;
+    return 0;
+}
+
+int get_trigram_index_stats(TrigramIndexStats *stats)
+{
+    if (!index_ready)
+        return 1;
+
+    *stats = index_.stats;
+    return 0;
+}
+
+void free_trigram_index(void)
+{
+    free_index(&index_);
+    index_ready = 0;
+}
@@ -17,8 +17,12 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
 
@@ -26,6 +30,14 @@
 FILE *debug_file = NULL;
 #endif
 
+/* Pipe that wakes up the main loop. Signal handlers write signal numbers
+ * to it, other threads write 0. */
+static int wakeup_fds[2] = { -1, -1 };
+static int wakeup_pending = 0;
+
+/* Bytes written to the pipe, so they are not counted as terminal output */
+static long wakeup_written = 0;
+
 size_t find_first_nonblank(char *string)
 {
     char c;
@@ -44,3 +56,107 @@ int size_t_compare(const void *a, const void *b)
 
     return (a_i < b_i) ? -1 : (a_i > b_i);
 }
+
+/*
+ * Get time in milliseconds from an arbitrary point
+ */
+long get_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Get time in microseconds from an arbitrary point
+ */
+long get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned get_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+int init_wakeup(void)
+{
+    if (pipe(wakeup_fds) == -1) {
+        set_errorf("failed to create pipe: %s", strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(wakeup_fds[i], F_SETFL, fcntl(wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return 0;
+}
+
+int get_wakeup_fd(void)
+{
+    return wakeup_fds[0];
+}
+
+/*
+ * Wake up the main loop. It's safe to call from signal handlers. Threads
+ * don't write to the pipe again until the main loop reads it.
+ */
+void wake_up(int signo)
+{
+    int saved_errno = errno;
+    char c = signo;
+
+    if (signo != 0 || !__atomic_exchange_n(&wakeup_pending, 1, __ATOMIC_RELAXED)) {
+        if (write(wakeup_fds[1], &c, 1) == -1) {
+            /* The pipe is full, so the main loop wakes up anyway */
+        } else {
+            __atomic_fetch_add(&wakeup_written, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    errno = saved_errno;
+}
+
+long get_wakeup_written(void)
+{
+    return __atomic_load_n(&wakeup_written, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read what woke up the main loop. Returns a signal number that was
+ * received, 0 if there is none.
+ */
+int read_wakeup(void)
+{
+    char buf[64];
+    ssize_t n;
+    int signo = 0;
+
+    __atomic_store_n(&wakeup_pending, 0, __ATOMIC_RELAXED);
+
+    while ((n = read(wakeup_fds[0], buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] != 0)
+                signo = buf[i];
+        }
+    }
+
+    return signo;
+}
+
+void deinit_wakeup(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (wakeup_fds[i] != -1)
+            close(wakeup_fds[i]);
+        wakeup_fds[i] = -1;
+    }
+}